@@ -0,0 +1,188 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Matching of scanned file names against module filters: DirectoryScanner
+// matching every filter on its own, versus unfiltered scan matched by
+// PathFilter DFA, as BatchQueueImpl::ScanFolder does it.
+// Generated names are created as empty files in a temporary folder, which is
+// removed afterwards. Both are checked to select the same names.
+// Usage: path_filter_bench [numNames] [numFilters]
+
+#include "datas/directory_scanner.hpp"
+#include "path_filter.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+static double Millis(clock_type::time_point since) {
+  return std::chrono::duration<double, std::milli>(clock_type::now() - since)
+      .count();
+}
+
+static std::string_view FileName(std::string_view path) {
+  const size_t lastSlash = path.find_last_of("/\\");
+
+  if (lastSlash != path.npos) {
+    path.remove_prefix(lastSlash + 1);
+  }
+
+  return path;
+}
+
+static std::string RandomWord(std::mt19937 &rng, size_t minSize,
+                              size_t maxSize) {
+  static constexpr char CHARS[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+  std::uniform_int_distribution<size_t> sizeDist(minSize, maxSize);
+  std::uniform_int_distribution<size_t> charDist(0, sizeof(CHARS) - 2);
+  std::string word(sizeDist(rng), ' ');
+
+  for (auto &c : word) {
+    c = CHARS[charDist(rng)];
+  }
+
+  return word;
+}
+
+int main(int argc, char *argv[]) {
+  const size_t numNames = argc > 1 ? strtoull(argv[1], nullptr, 10) : 200000;
+  const size_t numFilters = argc > 2 ? strtoull(argv[2], nullptr, 10) : 48;
+  std::mt19937 rng(1);
+
+  std::vector<std::string> extensions;
+  for (size_t i = 0; i < 32; i++) {
+    extensions.push_back(RandomWord(rng, 2, 4));
+  }
+
+  // Extension, prefix and infix filters, as modules use them
+  std::vector<std::string> filters;
+  for (size_t i = 0; i < numFilters; i++) {
+    switch (i % 3) {
+    case 0:
+      filters.push_back("." + extensions[i % extensions.size()] + "$");
+      break;
+    case 1:
+      filters.push_back("^" + RandomWord(rng, 2, 3) + "*");
+      break;
+    default:
+      filters.push_back("_" + RandomWord(rng, 2, 3) + "*." +
+                        extensions[(i * 7) % extensions.size()] + "$");
+      break;
+    }
+  }
+
+  std::set<std::string> names;
+  std::uniform_int_distribution<size_t> extDist(0, extensions.size() * 2 - 1);
+
+  while (names.size() < numNames) {
+    const size_t ext = extDist(rng);
+    names.insert(RandomWord(rng, 6, 24) + "." +
+                 (ext < extensions.size() ? extensions[ext]
+                                          : RandomWord(rng, 2, 4)));
+  }
+
+  const fs::path workFolder =
+      fs::temp_directory_path() /
+      ("path_filter_bench-" + std::to_string(clock_type::now()
+                                                 .time_since_epoch()
+                                                 .count()));
+  fs::create_directories(workFolder);
+
+  for (auto &name : names) {
+    FILE *file = fopen((workFolder / name).string().c_str(), "wb");
+
+    if (file) {
+      fclose(file);
+    }
+  }
+
+  // Warms up directory cache, both scans then list same cached entries
+  {
+    DirectoryScanner warmup;
+    warmup.Scan(workFolder.string());
+  }
+
+  auto startTime = clock_type::now();
+  DirectoryScanner separate;
+
+  for (auto &f : filters) {
+    separate.AddFilter(f);
+  }
+
+  separate.Scan(workFolder.string());
+  const double separateTime = Millis(startTime);
+
+  startTime = clock_type::now();
+  DirectoryScanner unfiltered;
+  unfiltered.Scan(workFolder.string());
+  PathFilter filter;
+
+  for (auto &f : filters) {
+    filter.AddFilter(f);
+  }
+
+  size_t numDfa = 0;
+
+  for (auto &f : unfiltered) {
+    numDfa += filter.IsFiltered(FileName(f));
+  }
+
+  const double dfaTime = Millis(startTime);
+
+  std::set<std::string, std::less<>> selected;
+
+  for (auto &f : separate) {
+    selected.emplace(FileName(f));
+  }
+
+  size_t numDiffer = 0;
+
+  for (auto &name : names) {
+    const bool expected = selected.contains(name);
+
+    if (filter.IsFiltered(name) != expected) {
+      if (numDiffer++ < 10) {
+        printf("%s: DirectoryScanner %s, PathFilter %s\n", name.c_str(),
+               expected ? "selects" : "skips",
+               expected ? "skips" : "selects");
+      }
+    }
+  }
+
+  fs::remove_all(workFolder);
+
+  printf("%zu names, %zu filters\n", numNames, numFilters);
+  printf("DirectoryScanner filters: %8.1f ms, %zu matched\n", separateTime,
+         selected.size());
+  printf("PathFilter DFA:           %8.1f ms, %zu matched\n", dfaTime,
+         numDfa);
+
+  if (numDiffer) {
+    printf("%zu names differ\n", numDiffer);
+    return 1;
+  }
+
+  return 0;
+}
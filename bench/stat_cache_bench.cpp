@@ -0,0 +1,113 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Stat cache save, open and lookup times for generated inputs.
+// Runs in a temporary folder, which is removed afterwards.
+// Usage: stat_cache_bench [numEntries]
+
+#include "stat_cache.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+static double Millis(clock_type::time_point since) {
+  return std::chrono::duration<double, std::milli>(clock_type::now() - since)
+      .count();
+}
+
+int main(int argc, char *argv[]) {
+  const size_t numEntries = argc > 1 ? strtoull(argv[1], nullptr, 10) : 60000;
+  static constexpr size_t NUM_OPENS = 100;
+  static constexpr char MODULE[] = "stat_cache_bench";
+
+  const fs::path workFolder =
+      fs::temp_directory_path() /
+      ("stat_cache_bench-" + std::to_string(clock_type::now()
+                                                .time_since_epoch()
+                                                .count()));
+  fs::create_directories(workFolder / "inputs");
+  const fs::path startFolder = fs::current_path();
+  // Cache folder is relative to working folder
+  fs::current_path(workFolder);
+
+  std::vector<std::string> paths;
+  paths.reserve(numEntries);
+
+  for (size_t i = 0; i < numEntries; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "inputs/%02zx/archive_%08zu.pak", i % 256,
+             i);
+    paths.emplace_back((workFolder / name).string());
+    fs::create_directories(fs::path(paths.back()).parent_path());
+
+    if (FILE *file = fopen(paths.back().c_str(), "wb")) {
+      fwrite(name, 1, i % 64, file);
+      fclose(file);
+    }
+  }
+
+  auto startTime = clock_type::now();
+  {
+    StatCache cache(MODULE, 0);
+
+    for (size_t i = 0; i < paths.size(); i++) {
+      cache.Insert(paths[i], i);
+    }
+
+    cache.Save();
+  }
+  const double saveTime = Millis(startTime);
+
+  startTime = clock_type::now();
+
+  for (size_t i = 0; i < NUM_OPENS; i++) {
+    StatCache cache(MODULE, 0);
+  }
+
+  const double openTime = Millis(startTime) / NUM_OPENS;
+
+  StatCache cache(MODULE, 0);
+  size_t numHits = 0;
+  startTime = clock_type::now();
+
+  for (auto &path : paths) {
+    numHits += cache.Find(path).has_value();
+  }
+
+  const double findTime = Millis(startTime);
+  const uintmax_t tableSize =
+      fs::file_size(*fs::directory_iterator("stat_cache"));
+
+  printf("%zu entries, %.2f MiB table\n", numEntries,
+         tableSize / double(1 << 20));
+  printf("insert and save: %8.2f ms\n", saveTime);
+  printf("open:            %8.3f ms\n", openTime);
+  printf("find:            %8.2f ms, %.0f lookups/s, %zu hits\n", findTime,
+         numEntries / (findTime / 1000), numHits);
+
+  fs::current_path(startFolder);
+  fs::remove_all(workFolder);
+
+  return numHits == numEntries ? 0 : 1;
+}
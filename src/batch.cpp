@@ -16,10 +16,29 @@
 */
 
 #include "spike/batch.hpp"
+#include "batch_record.hpp"
 #include "datas/master_printer.hpp"
+#include "folder_watch.hpp"
+#include "lease.hpp"
 #include "main.hpp"
+#include "mapped_file.hpp"
+#include "path_filter.hpp"
+#include "planner.hpp"
+#include "prefetch.hpp"
+#include "ram_storage.hpp"
+#include "result_cache.hpp"
+#include "shard.hpp"
+#include "stat_cache.hpp"
 #include "spike/console.hpp"
+#include "temp_cleanup.hpp"
+#include "worker_farm.hpp"
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <optional>
+#include <set>
 #include <thread>
 
 struct ProcessedFiles : LoadingBar, CounterLine {
@@ -33,37 +52,108 @@ struct ProcessedFiles : LoadingBar, CounterLine {
   }
 };
 
+// Opening and finishing a file has a cost of its own, so queue of many
+// empty files still progresses
+static constexpr uint64_t FILE_OVERHEAD = 4096;
+
+// RAM temp storage is measured at most this often between dispatched files
+
+static uint64_t FileSize(std::string_view path) {
+  std::error_code ec;
+  const uint64_t fileSize = std::filesystem::file_size(path, ec);
+  return ec ? 0 : fileSize;
+}
+
+// Positional read, stream is only used for special files
+static std::string ReadChunk(const InputFile &file, AppContextShare *iCtx,
+                             size_t offset, size_t size) {
+  if (file.Opened()) {
+    return file.Read(size, offset);
+  }
+
+  return iCtx->GetBuffer(size, offset);
+}
+
 struct ExtractStats {
   std::map<JenHash, size_t> archiveFiles;
   size_t totalFiles = 0;
 };
 
+// In summary mode, per file lines are replaced by periodic count of
+// processed files. Warnings and errors are not affected.
+struct FileLog {
+  using clock = std::chrono::steady_clock;
+  static constexpr clock::duration INTERVAL = std::chrono::seconds(2);
+
+  bool summary = false;
+  std::atomic_size_t pending{0};
+  std::atomic<clock::rep> lastFlush{clock::now().time_since_epoch().count()};
+
+  // getPath is only called when line is printed
+  template <class PathFn> void Processing(PathFn &&getPath) {
+    if (!summary) {
+      printline("Processing: " << getPath());
+      return;
+    }
+
+    pending.fetch_add(1, std::memory_order_relaxed);
+    const clock::rep now = clock::now().time_since_epoch().count();
+    clock::rep last = lastFlush.load(std::memory_order_relaxed);
+
+    // Only one thread wins the flush of current interval
+    if (now - last < INTERVAL.count() ||
+        !lastFlush.compare_exchange_strong(last, now,
+                                           std::memory_order_relaxed)) {
+      return;
+    }
+
+    if (const size_t numFiles = pending.exchange(0)) {
+      printline("Processing: " << numFiles << " files, latest "
+                               << getPath());
+    }
+  }
+
+  ~FileLog() {
+    if (const size_t numFiles = pending.exchange(0)) {
+      printline("Processing: " << numFiles << " files");
+    }
+  }
+};
+
 struct UILines {
   ProgressBar *totalProgress{nullptr};
   CounterLine *totalCount{nullptr};
-  std::map<uint32, ProgressBar *> bars;
-  std::mutex barsMutex;
+  FileLog fileLog;
+  // Fixed after construction, so workers can read it without locking
+  std::vector<ProgressBar *> bars;
+  // Distinguishes batches in thread_local slot cache of workers
+  const uint64_t generation = NextGeneration();
+  std::atomic_size_t numWorkers{0};
+
+  static uint64_t NextGeneration() {
+    static std::atomic_uint64_t lastGeneration{0};
+    return ++lastGeneration;
+  }
 
-  auto ChooseBar() {
+  // Every worker thread gets its own bar on first use.
+  // Bars are shared only when there are more workers than bars.
+  ProgressBar *ChooseBar() {
     if (bars.empty()) {
-      return (ProgressBar *)(nullptr);
+      return nullptr;
     }
 
-    auto threadId = std::this_thread::get_id();
-    auto id = reinterpret_cast<const uint32 &>(threadId);
-    auto found = bars.find(id);
-
-    if (es::IsEnd(bars, found)) {
-      std::lock_guard<std::mutex> lg(barsMutex);
-      auto retVal = bars.begin()->second;
-      bars.emplace(id, retVal);
-      bars.erase(bars.begin());
+    thread_local struct {
+      uint64_t generation = 0;
+      size_t index = 0;
+    } worker;
 
-      return retVal;
+    if (worker.generation != generation) {
+      worker.generation = generation;
+      worker.index = numWorkers.fetch_add(1, std::memory_order_relaxed);
     }
 
-    return found->second;
-  };
+    return bars[worker.index % bars.size()];
+  }
 
   UILines(const ExtractStats &stats) {
     ModifyElements([&](ElementAPI &api) {
@@ -77,8 +167,7 @@ struct UILines {
 
       for (size_t t = 0; t < minThreads; t++) {
         auto progBar = std::make_unique<ProgressBar>("Thread:");
-        auto progBarRaw = progBar.get();
-        bars.emplace(t, progBarRaw);
+        bars.emplace_back(progBar.get());
         api.Append(std::move(progBar));
       }
     });
@@ -88,10 +177,12 @@ struct UILines {
     totalCount = prog;
   }
 
-  UILines(size_t totalInputFiles) {
+  // Total progress is weighted by input size, see FILE_OVERHEAD
+  UILines() {
     totalCount = AppendNewLogLine<ProcessedFiles>();
     auto prog = AppendNewLogLine<DetailedProgressBar>("Total: ");
-    prog->ItemCount(totalInputFiles);
+    prog->ItemCount(1);
+    ProgressInBytes(prog);
     totalProgress = prog;
   }
 
@@ -111,6 +202,104 @@ struct UILines {
 
 struct BatchQueueImpl;
 
+// Tells queued inputs apart from outputs written next to them, thread safe
+struct QueuedInputs {
+  PathFilter filter;
+  std::mutex filterMutex;
+  // Normalized paths of queued files
+  std::set<std::string, std::less<>> files;
+
+  bool Contains(const std::filesystem::path &path) {
+    if (files.contains(path.lexically_normal().generic_string())) {
+      return true;
+    }
+
+    std::lock_guard<std::mutex> lg(filterMutex);
+    return filter.IsFiltered(path.filename().string());
+  }
+};
+
+// Worker process side of StartWorkerFarm
+struct FarmWorker {
+  APPContext ctx;
+  std::unique_ptr<ResultCache> cache;
+  QueuedInputs queuedInputs;
+  bool summaryLog = false;
+
+  void ProcessFile(const std::string &path,
+                   const std::function<void()> &item) {
+    std::string cacheKey;
+
+    if (cache) {
+      cacheKey = cache->Key(path);
+
+      if (cache->Restore(cacheKey, path)) {
+        return;
+      }
+    }
+
+    ResultCache::Snapshot before;
+
+    if (cache) {
+      before = ResultCache::Scan(
+          path, [this](auto &p) { return queuedInputs.Contains(p); });
+    }
+
+    auto iCtx = MakeIOContext(path);
+    iCtx->forEachFile = item;
+
+    // Summary is made by main process
+    if (!summaryLog) {
+      printline("Processing: " << iCtx->FullPath());
+    }
+
+    ctx.ProcessFile(iCtx.get());
+    iCtx->Finish();
+
+    if (cache) {
+      cache->Store(cacheKey, path, before);
+    }
+  }
+};
+
+// Loads setup made by StartWorkerFarm in worker process
+static WorkerFarm::process_fn LoadFarmWorker(std::string_view setup) {
+  auto worker = std::make_shared<FarmWorker>();
+  std::string_view ctxSetup = TakeSetupField(setup);
+
+  if (ctxSetup.starts_with(WORKER_SETUP_REPLAY)) {
+    worker->ctx = LoadReplayWorker(ctxSetup.substr(1));
+  } else if (ctxSetup.starts_with(WORKER_SETUP_MODULE)) {
+    worker->ctx = LoadModuleWorker(ctxSetup.substr(1));
+  } else {
+    throw std::runtime_error("Malformed worker setup");
+  }
+
+  worker->summaryLog = !TakeSetupField(setup).empty();
+  const std::string cacheFolder(TakeSetupField(setup));
+  const uint64_t settingsHash =
+      std::stoull(std::string(TakeSetupField(setup)));
+  const auto linkPolicy =
+      LinkPolicy(std::stoi(std::string(TakeSetupField(setup))));
+
+  if (!cacheFolder.empty()) {
+    worker->cache =
+        std::make_unique<ResultCache>(cacheFolder, settingsHash, linkPolicy);
+  }
+
+  for (auto &c : worker->ctx.info->filters) {
+    worker->queuedInputs.filter.AddFilter(c);
+  }
+
+  while (!setup.empty()) {
+    worker->queuedInputs.files.emplace(TakeSetupField(setup));
+  }
+
+  return [worker](const std::string &path, const std::function<void()> &item) {
+    worker->ProcessFile(path, item);
+  };
+}
+
 struct ExtractStatsMaker : ExtractStats {
   std::mutex mtx;
   LoadingBar *scanBar;
@@ -124,55 +313,835 @@ struct ExtractStatsMaker : ExtractStats {
   ~ExtractStatsMaker() { scanBar->Finish(); }
 };
 
-void ProcessBatch(BatchQueueImpl &batch, size_t numFiles);
+void ProcessBatch(BatchQueueImpl &batch);
 std::shared_ptr<ExtractStatsMaker> ExtractStatBatch(BatchQueueImpl &batch);
 void ProcessBatch(BatchQueueImpl &batch, ExtractStats *stats);
 void PackModeBatch(BatchQueueImpl &batch);
 
 struct BatchQueueImpl : QueueContext {
-  void ProcessQueueInernal() {
-    for (auto &q : queue) {
-      const std::string fullPath = q.path0 + "/" + q.path1;
+  // Filters are matched here instead of in DirectoryScanner, so every path
+  // is tested by a single automaton pass instead of once per filter.
+  std::vector<std::string_view> ScanFolder(const std::string &path) {
+    scanner.Scan(path);
+    std::vector<std::string_view> files;
 
-      if (q.isFolder) {
-        scanner.Scan(fullPath);
+    for (auto &f : scanner) {
+      std::string_view fileName(f);
+      const size_t lastSlash = fileName.find_last_of("/\\");
+
+      if (lastSlash != fileName.npos) {
+        fileName.remove_prefix(lastSlash + 1);
+      }
+
+      if (filter.IsFiltered(fileName)) {
+        files.emplace_back(f);
+      }
+    }
+
+    return files;
+  }
+
+  // Announces files that are about to be pushed, returns their sizes
+  template <class C> std::vector<uint64_t> AddWorkload(const C &files) {
+    // Sizes are only used for progress, statistics and reports
+    const bool needSizes =
+        updateWorkload || throughput || prefetch || shard.Active();
+    std::vector<uint64_t> sizes;
+    sizes.reserve(files.size());
+    uint64_t workload = 0;
+
+    for (auto &f : files) {
+      sizes.push_back(needSizes ? FileSize(f) : 0);
+      workload += sizes.back() + FILE_OVERHEAD;
+    }
+
+    if (updateWorkload) {
+      updateWorkload(workload);
+    }
+
+    return sizes;
+  }
+
+  // Dispatch blocks once worker queue is full, so files are handed to
+  // prefetcher upfront. Returns ticket of first file, rest follow in order.
+  template <class C>
+  uint64_t PrefetchFiles(const C &files, const std::vector<uint64_t> &sizes,
+                         size_t begin, size_t end) {
+    uint64_t firstTicket = 0;
+
+    for (size_t i = begin; prefetch && i < end; i++) {
+      const uint64_t ticket = prefetch->Push(std::string(files[i]), sizes[i]);
+
+      if (i == begin) {
+        firstTicket = ticket;
+      }
+    }
+
+    return firstTicket;
+  }
+
+  // Ticket from PrefetchFiles
+  void PushFile(std::string path, uint64_t fileSize, uint64_t ticket) {
+    const RamStorageUsage ramUsage = RamStorageStatus();
+    const bool sampled = throughput && throughput->SampleOutputs(path);
+
+    if (farm) {
+      // Every worker has its own temp storage, file goes to disk when RAM
+      // is full
+      std::string tempFolder;
+
+      if (ramUsage.active) {
+        tempFolder = ramUsage.full ? DiskTempFolder() : RamStorageFolder();
+      }
+
+      FarmFile &file =
+          farmFiles.emplace(path, FarmFile{fileSize, ticket, {}, sampled})
+              ->second;
+
+      if (watching || sampled) {
+        file.watched = ResultCache::Scan(path, nullptr);
+      }
+
+      farm->Push(path, tempFolder);
+      return;
+    }
+
+    // Threads share temp storage, it can only be moved when no file is
+    // running. Running files hold their intermediates in RAM until they
+    // finish, so they are waited for first.
+    if (ramUsage.full && !ramSpilled) {
+      WaitFiles();
+
+      if (RamStorageStatus().full) {
+        ramSpilled = true;
+        printwarning("RAM temp storage is full with no file running, "
+                     "continuing on disk.");
+        SwitchTempFolder(DiskTempFolder());
+      }
+    }
+
+    auto iCtx = MakeIOContext(path);
+    manager.Push([&, iCtx{std::move(iCtx)}, path{std::move(path)}, fileSize,
+                  ticket, sampled] {
+      if (prefetch) {
+        prefetch->Started(ticket);
+      }
 
-        if (updateFileCount) {
-          const size_t numFiles = scanner.Files().size();
-          updateFileCount(numFiles ? numFiles - 1 : 0);
+      const auto startTime = std::chrono::steady_clock::now();
+      ResultCache::Snapshot watched;
+
+      if (watching || sampled) {
+        watched = ResultCache::Scan(path, nullptr);
+      }
+
+      std::string cacheKey;
+
+      if (cache) {
+        cacheKey = cache->Key(path);
+
+        if (cache->Restore(cacheKey, path)) {
+          RecordProduced(path, watched, sampled, fileSize);
+          FileFinished(path, fileSize, 0, true);
+          return;
+        }
+      }
+
+      ResultCache::Snapshot before;
+
+      if (cache) {
+        before = ResultCache::Scan(
+            path, [this](auto &p) { return queuedInputs.Contains(p); });
+      }
+
+      try {
+        forEachFile(iCtx.get());
+      } catch (...) {
+        RecordProduced(path, watched, false, fileSize);
+        FileFinished(path, fileSize, 0, false);
+        throw;
+      }
+
+      iCtx->Finish();
+
+      if (cache) {
+        cache->Store(cacheKey, path, before);
+      }
+
+      RecordProduced(path, watched, sampled, fileSize);
+      const std::chrono::duration<double> duration =
+          std::chrono::steady_clock::now() - startTime;
+      FileFinished(path, fileSize, duration.count(), true);
+    });
+  }
+
+  void FileFinished(const std::string &path, uint64_t fileSize,
+                    double seconds, bool succeeded) {
+    if (succeeded) {
+      jobStats.numFiles++;
+      jobStats.numBytes += fileSize;
+
+      // Restored from cache
+      if (throughput && seconds > 0) {
+        throughput->Record(path, fileSize, seconds);
+      }
+    } else {
+      jobStats.numFailed++;
+    }
+
+    if (recorder) {
+      recorder->Add(path, fileSize, seconds, succeeded);
+    }
+
+    if (workloadDone) {
+      workloadDone(fileSize + FILE_OVERHEAD);
+    }
+
+    if (leasedPass) {
+      std::lock_guard<std::mutex> lg(leasedFiles.mutex);
+
+      if (auto found = leasedFiles.chunks.find(path);
+          found != leasedFiles.chunks.end()) {
+        if (!--leasedFiles.numRunning[found->second]) {
+          leasedFiles.numRunning.erase(found->second);
+          leasedFiles.chunkDone.notify_all();
+        }
+
+        leasedFiles.chunks.erase(found);
+      }
+    }
+  }
+
+  bool LeasedChunkRunning(size_t chunk) {
+    std::lock_guard<std::mutex> lg(leasedFiles.mutex);
+    return leasedFiles.numRunning.contains(chunk);
+  }
+
+  void WaitLeasedChunk(size_t chunk) {
+    if (farm) {
+      farm->WaitUntil([&] { return !LeasedChunkRunning(chunk); });
+      return;
+    }
+
+    std::unique_lock<std::mutex> lk(leasedFiles.mutex);
+    leasedFiles.chunkDone.wait(
+        lk, [&] { return !leasedFiles.numRunning.contains(chunk); });
+  }
+
+  // All files of the queue are ordered by key and split into chunks,
+  // that are pulled by every instance sharing the lease folder.
+  void ProcessLeasedQueue() {
+    struct Item {
+      std::string path;
+      size_t keyOffset;
+      uint64_t size = 0;
+
+      std::string_view Key() const {
+        return std::string_view(path).substr(keyOffset);
+      }
+    };
+
+    std::vector<Item> items;
+
+    for (auto &q : queue) {
+      if (q.isFolder) {
+        for (auto f : ScanFolder(q.path0 + "/" + q.path1)) {
+          items.push_back({std::string(f), q.path0.size() + 1});
         }
+      } else {
+        items.push_back({q.path0 + "/" + q.path1, q.path0.size() + 1});
+      }
+    }
+
+    std::sort(items.begin(), items.end(),
+              [](auto &i0, auto &i1) { return i0.Key() < i1.Key(); });
 
-        if (forEachFolder) {
-          AppPackStats stats{};
-          stats.numFiles = scanner.Files().size();
+    std::vector<std::string_view> paths;
 
-          for (auto &f : scanner) {
-            stats.totalSizeFileNames += f.size() + 1;
+    for (auto &i : items) {
+      paths.emplace_back(i.path);
+    }
+
+    auto sizes = AddWorkload(paths);
+
+    for (size_t i = 0; i < items.size(); i++) {
+      items[i].size = sizes[i];
+    }
+
+    const size_t chunkSize = options.leaseChunkSize;
+    const size_t numChunks = (items.size() + chunkSize - 1) / chunkSize;
+    auto ChunkEnd = [&](size_t chunk) {
+      return std::min((chunk + 1) * chunkSize, items.size());
+    };
+
+    // Changed settings or job start new board, done markers are kept
+    char settingsHash[32]{};
+    snprintf(settingsHash, sizeof(settingsHash), "%016" PRIx64,
+             SettingsHash(*ctx));
+    LeaseBoard board(options.leaseFolder + "/" +
+                         JobId("lease-" + std::to_string(chunkSize) + "-" +
+                               settingsHash),
+                     numChunks, std::chrono::seconds(options.leaseTimeout));
+
+    board.foreignDone = [&](size_t chunk) {
+      int64_t workload = 0;
+
+      for (size_t i = chunk * chunkSize; i < ChunkEnd(chunk); i++) {
+        workload += items[i].size + FILE_OVERHEAD;
+      }
+
+      if (updateWorkload) {
+        updateWorkload(-workload);
+      }
+    };
+
+    if (numChunks && board.NumDone() == numChunks) {
+      printwarning("Every chunk of this queue was already processed in "
+                   << options.leaseFolder
+                   << ", set different lease job to process it again.");
+    }
+
+    // Chunk is completed once its own files finished. Next chunk is leased
+    // and dispatched meanwhile, so workers don't idle on its slowest file.
+    std::deque<size_t> running;
+    auto CompleteOldest = [&] {
+      WaitLeasedChunk(running.front());
+      board.Complete(running.front());
+      running.pop_front();
+    };
+
+    while (auto chunk = board.Claim()) {
+      const size_t begin = *chunk * chunkSize;
+      const uint64_t firstTicket =
+          PrefetchFiles(paths, sizes, begin, ChunkEnd(*chunk));
+
+      for (size_t i = begin; i < ChunkEnd(*chunk); i++) {
+        // New owner processes the rest
+        if (!board.Owns(*chunk)) {
+          int64_t workload = 0;
+
+          for (; i < ChunkEnd(*chunk); i++) {
+            workload += items[i].size + FILE_OVERHEAD;
+
+            if (prefetch) {
+              prefetch->Cancel(firstTicket + i - begin);
+            }
+          }
+
+          if (updateWorkload) {
+            updateWorkload(-workload);
           }
 
-          forEachFolder(fullPath, stats);
+          break;
         }
 
-        for (auto &f : scanner) {
-          manager.Push([&, iCtx{MakeIOContext(f)}] {
-            forEachFile(iCtx.get());
-            iCtx->Finish();
-          });
+        {
+          std::lock_guard<std::mutex> lg(leasedFiles.mutex);
+          leasedFiles.chunks.emplace(items[i].path, *chunk);
+          leasedFiles.numRunning[*chunk]++;
+        }
+
+        PushFile(items[i].path, items[i].size, firstTicket + i - begin);
+      }
+
+      running.push_back(*chunk);
+
+      if (running.size() > 1) {
+        CompleteOldest();
+      }
+    }
+
+    while (!running.empty()) {
+      CompleteOldest();
+    }
+
+    Clean();
+  }
+
+  void ProcessQueueInernal() {
+    if (leasedPass) {
+      ProcessLeasedQueue();
+      return;
+    }
+
+    // Whole queue is scanned before dispatch, so progress gets full workload
+    // at once instead of growing with every folder
+    struct Group {
+      // Loose files have none
+      const Queue *folder = nullptr;
+      std::vector<std::string> files;
+      size_t begin = 0;
+    };
+
+    std::vector<Group> groups;
+    std::vector<const Queue *> looseFiles;
+
+    for (auto &q : queue) {
+      if (!q.isFolder) {
+        looseFiles.emplace_back(&q);
+        continue;
+      }
+
+      // Packed folders are never split between shards
+      if (forEachFolder && shard.Active() && !shard.Owns(q.path1)) {
+        continue;
+      }
+
+      auto files = ScanFolder(q.path0 + "/" + q.path1);
+
+      if (!forEachFolder) {
+        shard.Apply(files, q.path0.size() + 1);
+      }
+
+      // Scanner storage is reused by next folder
+      groups.push_back({&q, {files.begin(), files.end()}});
+    }
+
+    shard.Apply(looseFiles);
+    Group &loose = groups.emplace_back();
+
+    for (auto q : looseFiles) {
+      loose.files.emplace_back(q->path0 + "/" + q->path1);
+    }
+
+    std::vector<std::string_view> allFiles;
+
+    for (auto &g : groups) {
+      g.begin = allFiles.size();
+      allFiles.insert(allFiles.end(), g.files.begin(), g.files.end());
+    }
+
+    auto sizes = AddWorkload(allFiles);
+
+    for (auto &g : groups) {
+      if (g.folder && forEachFolder) {
+        AppPackStats stats{};
+        stats.numFiles = g.files.size();
+
+        for (auto &f : g.files) {
+          stats.totalSizeFileNames += f.size() + 1;
         }
 
-        manager.Wait();
+        forEachFolder(g.folder->path0 + "/" + g.folder->path1, stats);
+      }
+
+      const uint64_t firstTicket =
+          PrefetchFiles(allFiles, sizes, g.begin, g.begin + g.files.size());
+
+      for (size_t i = 0; i < g.files.size(); i++) {
+        PushFile(std::move(g.files[i]), sizes[g.begin + i], firstTicket + i);
+      }
+
+      if (g.folder) {
+        WaitFiles();
 
         if (forEachFolderFinish) {
           forEachFolderFinish();
         }
-      } else {
-        manager.Push([&, iCtx{MakeIOContext(fullPath)}] {
-          forEachFile(iCtx.get());
-          iCtx->Finish();
+      }
+    }
+
+    Clean();
+  }
+
+  std::string JobId(const std::string &variant) const {
+    std::vector<std::string_view> keys;
+
+    for (auto &q : queue) {
+      keys.emplace_back(q.path1);
+    }
+
+    std::sort(keys.begin(), keys.end());
+    uint64_t hash = PathHash(ctx->info->header);
+
+    for (auto k : keys) {
+      hash = PathHash(k, PathHash("\n", hash));
+    }
+
+    hash = PathHash(variant, PathHash(options.jobName, hash));
+
+    char buffer[32]{};
+    snprintf(buffer, sizeof(buffer), "%016" PRIx64, hash);
+    return buffer;
+  }
+
+  // Expands queue into files this node would process, without processing
+  // them. Estimates duration from history of previous runs.
+  void PlanQueue() override {
+    QueuePlan plan;
+    std::vector<std::string> files;
+
+    for (auto &q : queue) {
+      if (!q.isFolder) {
+        continue;
+      }
+
+      if (ctx->NewArchive && shard.Active() && !shard.Owns(q.path1)) {
+        continue;
+      }
+
+      auto folderFiles = ScanFolder(q.path0 + "/" + q.path1);
+
+      if (!ctx->NewArchive) {
+        shard.Apply(folderFiles, q.path0.size() + 1);
+      }
+
+      for (auto f : folderFiles) {
+        files.emplace_back(f);
+      }
+    }
+
+    std::vector<const Queue *> looseFiles;
+
+    for (auto &q : queue) {
+      if (!q.isFolder) {
+        looseFiles.emplace_back(&q);
+      }
+    }
+
+    shard.Apply(looseFiles);
+
+    for (auto q : looseFiles) {
+      files.emplace_back(q->path0 + "/" + q->path1);
+    }
+
+    scanner.Clear();
+
+    for (auto &f : files) {
+      std::error_code ec;
+      const uint64_t fileSize = std::filesystem::file_size(f, ec);
+
+      if (ec) {
+        plan.numFailed++;
+        continue;
+      }
+
+      auto &group = plan.groups[FileExtension(f)];
+      group.numFiles++;
+      group.numBytes += fileSize;
+    }
+
+    if (ctx->ExtractStat) {
+      std::atomic_size_t numOutputFiles{0};
+      std::atomic_size_t numFailed{0};
+      auto scanBar = AppendNewLogLine<LoadingBar>("Processing extract stats.");
+      StatCache statCache(ctx->info->header, SettingsHash(*ctx));
+
+      for (auto &f : files) {
+        manager.Push([&, &path = f] {
+          if (auto cached = statCache.Find(path)) {
+            numOutputFiles += *cached;
+            return;
+          }
+
+          try {
+            InputFile file(path);
+            std::unique_ptr<AppContextShare> iCtx;
+
+            if (!file.Opened()) {
+              iCtx = MakeIOContext(path);
+            }
+
+            const size_t numFiles = ctx->ExtractStat(
+                [&](size_t offset, size_t size) {
+                  return ReadChunk(file, iCtx.get(), offset, size);
+                });
+            statCache.Insert(path, numFiles);
+            numOutputFiles += numFiles;
+          } catch (...) {
+            numFailed++;
+          }
         });
       }
+
+      manager.Wait();
+      statCache.Save();
+      scanBar->Finish();
+      plan.numOutputFiles = numOutputFiles;
+      plan.hasOutputFiles = true;
+      plan.numFailed += numFailed;
+    }
+
+    size_t numWorkers = 1;
+
+    if (options.workerProcesses > 0 && !ctx->NewArchive) {
+      numWorkers = options.workerProcesses;
+    } else if (ctx->info->multithreaded && !ctx->NewArchive) {
+      numWorkers = std::thread::hardware_concurrency();
+    }
+
+    PrintQueuePlan(plan, ThroughputHistory(ctx->info->header), numWorkers);
+  }
+
+  void WaitFiles() {
+    if (farm) {
+      farm->Wait();
+    } else {
+      manager.Wait();
+    }
+  }
+
+  // Final pass in worker processes, so crashing module doesn't take down
+  // whole batch. Pack mode streams into single archive and stays in process.
+  void StartWorkerFarm() {
+    if (workerSetup.empty()) {
+      printwarning("Worker processes cannot load this job, processing in "
+                   "threads.");
+      return;
+    }
+
+    // Read by LoadFarmWorker
+    const bool summaryLog = options.logVerbosity == LogVerbosity::Summary;
+    std::string setup;
+    AppendSetupField(setup, workerSetup);
+    AppendSetupField(setup, summaryLog ? "summary" : "");
+    AppendSetupField(setup, cache ? options.cacheFolder : "");
+    AppendSetupField(setup, std::to_string(cache ? SettingsHash(*ctx) : 0));
+    AppendSetupField(setup, std::to_string(int(options.linkPolicy)));
+
+    for (auto &f : queuedInputs.files) {
+      AppendSetupField(setup, f);
+    }
+
+    farm = MakeWorkerFarm(options.workerProcesses,
+                          std::chrono::seconds(options.workerTimeout),
+                          std::move(setup));
+
+    if (!farm) {
+      return;
+    }
+
+    farm->onItem = [&] {
+      if (forEachRemoteItem) {
+        forEachRemoteItem();
+      }
+    };
+
+    farm->onFile = [&](const std::string &path, bool succeeded,
+                       double seconds) {
+      uint64_t fileSize = 0;
+
+      if (auto found = farmFiles.find(path); found != farmFiles.end()) {
+        fileSize = found->second.size;
+
+        // Start in worker is not reported, window spans processed files too
+        if (prefetch) {
+          prefetch->Started(found->second.ticket);
+        }
+
+        RecordProduced(path, found->second.watched,
+                       succeeded && found->second.sampled, fileSize);
+
+        farmFiles.erase(found);
+      }
+
+      FileFinished(path, fileSize, seconds, succeeded);
+
+      if (succeeded && forEachRemoteFile) {
+        forEachRemoteFile(path);
+      }
+    };
+  }
+
+  // Outputs of watch jobs raise events of their own, remembers their state
+  // so those events are told apart from later changes. Thread safe.
+  // Sampled outputs are measured for throughput history
+  void RecordProduced(const std::string &path,
+                      const ResultCache::Snapshot &before, bool sampled,
+                      uint64_t fileSize) {
+    if (!watching && !sampled) {
+      return;
+    }
+
+    const std::filesystem::path folder =
+        std::filesystem::path(path).parent_path();
+    auto outputs = ResultCache::Collect(path, before);
+
+    if (sampled && outputs.complete) {
+      throughput->RecordOutputs(path, fileSize, outputs.numBytes);
+    }
+
+    if (!watching) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lg(producedMutex);
+
+    for (auto &o : outputs.paths) {
+      const std::filesystem::path output = folder / o;
+      std::error_code ec;
+      const auto time = std::filesystem::last_write_time(output, ec);
+      const uint64_t size = std::filesystem::file_size(output, ec);
+
+      if (!ec) {
+        produced.insert_or_assign(output.lexically_normal().generic_string(),
+                                  ResultCache::FileState{time, size});
+      }
+    }
+  }
+
+  // Event of file is caused by this job, consumes its record
+  bool IsProduced(std::string_view path) {
+    std::lock_guard<std::mutex> lg(producedMutex);
+    auto found = produced.find(std::filesystem::path(path)
+                                   .lexically_normal()
+                                   .generic_string());
+
+    if (found == produced.end()) {
+      return false;
+    }
+
+    std::error_code ec;
+    const auto time = std::filesystem::last_write_time(path, ec);
+    const uint64_t size = std::filesystem::file_size(path, ec);
+    const bool unchanged =
+        !ec && found->second == ResultCache::FileState{time, size};
+    produced.erase(found);
+
+    return unchanged;
+  }
+
+  void BeginFinalPass() {
+    queuedInputs.files.clear();
+
+    for (auto &q : queue) {
+      if (!q.isFolder) {
+        queuedInputs.files.emplace(std::filesystem::path(q.path0 + "/" + q.path1)
+                                .lexically_normal()
+                                .generic_string());
+      }
+    }
+
+    // Archives are not single file outputs
+    if (!options.cacheFolder.empty() && !ctx->NewArchive) {
+      cache = std::make_unique<ResultCache>(
+          options.cacheFolder, SettingsHash(*ctx), options.linkPolicy);
+    }
+
+    if (options.workerProcesses > 0 && !ctx->NewArchive) {
+      StartWorkerFarm();
+    }
+
+    if (options.prefetchWindow > 0) {
+      prefetch = std::make_unique<Prefetcher>(
+          uint64_t(options.prefetchWindow) << 20, options.prefetchMode);
+    }
+
+    throughput = std::make_unique<ThroughputHistory>(ctx->info->header);
+
+    if (!options.recordFile.empty()) {
+      recorder = std::make_unique<BatchRecorder>(
+          ctx->info->header, SettingsHash(*ctx), options,
+          ctx->info->multithreaded ? std::thread::hardware_concurrency() : 1);
+    }
+  }
+
+  void EndFinalPass() {
+    farm.reset();
+
+    if (ramSpilled) {
+      manager.Wait();
+      SwitchTempFolder(RamStorageFolder());
+      ramSpilled = false;
+    }
+
+    prefetch.reset();
+
+    if (cache) {
+      cache->PrintSavings();
+      cache.reset();
+    }
+    throughput->Save();
+    throughput.reset();
+
+    if (recorder) {
+      recorder->Save(options.recordFile);
+      recorder.reset();
+    }
+  }
+
+  // Processes files written into queued folders until stop is set.
+  // Only changed files are processed, folders are never rescanned.
+  void WatchQueue(const std::atomic_bool &stop) override {
+    if (ctx->NewArchive) {
+      printerror("Watching is not supported in pack mode.");
+      return;
+    }
+
+    FolderWatch watch;
+
+    if (!watch.Supported()) {
+      printerror("Watching folders is not supported on this platform.");
+      return;
+    }
+
+    std::set<std::string, std::less<>> looseFiles;
+
+    for (auto &q : queue) {
+      const std::string fullPath = q.path0 + "/" + q.path1;
+
+      if (q.isFolder) {
+        watch.AddFolder(fullPath, true);
+      } else {
+        looseFiles.emplace(fullPath);
+        watch.AddFolder(std::filesystem::path(fullPath).parent_path().string(),
+                        false);
+      }
+    }
+
+    // Key used for sharding, relative to mount
+    auto FileKey =
+        [&](std::string_view path) -> std::optional<std::string_view> {
+      for (auto &q : queue) {
+        if (q.isFolder ? path.starts_with(q.path0 + "/" + q.path1 + "/")
+                       : path == q.path0 + "/" + q.path1) {
+          return path.substr(q.path0.size() + 1);
+        }
+      }
+
+      return std::nullopt;
+    };
+
+    printinfo("Watching " << queue.size() << " queue items for changes.");
+    ProcessBatch(*this);
+    BeginFinalPass();
+    watching = true;
+
+    while (!stop) {
+      auto changed = watch.Wait(std::chrono::milliseconds(500), stop);
+      std::vector<std::string_view> files;
+
+      for (auto &c : changed) {
+        std::string_view fileName(c);
+        const size_t lastSlash = fileName.find_last_of("/\\");
+
+        if (lastSlash != fileName.npos) {
+          fileName.remove_prefix(lastSlash + 1);
+        }
+
+        auto key = FileKey(c);
+
+        if (key && (looseFiles.contains(c) || filter.IsFiltered(fileName)) &&
+            (!shard.Active() || shard.Owns(*key)) && !IsProduced(c)) {
+          files.emplace_back(c);
+        }
+      }
+
+      if (files.empty()) {
+        continue;
+      }
+
+      auto sizes = AddWorkload(files);
+      const uint64_t firstTicket =
+          PrefetchFiles(files, sizes, 0, files.size());
+
+      for (size_t i = 0; i < files.size(); i++) {
+        PushFile(std::string(files[i]), sizes[i], firstTicket + i);
+      }
+
+      WaitFiles();
     }
 
+    EndFinalPass();
     Clean();
   }
 
@@ -181,42 +1150,136 @@ struct BatchQueueImpl : QueueContext {
       PackModeBatch(*this);
     } else {
       if (ctx->ExtractStat) {
+        statCache =
+            std::make_unique<StatCache>(ctx->info->header, SettingsHash(*ctx));
         auto stats = ExtractStatBatch(*this);
         ProcessQueueInernal();
+        statCache->Save();
+        statCache.reset();
         stats.get()->totalFiles += queue.size();
         ProcessBatch(*this, stats.get());
       } else {
-        ProcessBatch(*this, queue.size());
+        ProcessBatch(*this);
       }
     }
 
+    jobStats.numFiles = 0;
+    jobStats.numFailed = 0;
+    jobStats.numBytes = 0;
+    const auto startTime = std::chrono::steady_clock::now();
+    // Stat pass is always local, only the final pass pulls leased chunks
+    leasedPass = !options.leaseFolder.empty() && !ctx->NewArchive;
+
+    BeginFinalPass();
     ProcessQueueInernal();
+    leasedPass = false;
+    EndFinalPass();
+
+    if (shard.Active() && options.leaseFolder.empty() && !queue.empty()) {
+      ShardReport report;
+      report.jobId = JobId("shard-" + std::to_string(shard.count) + "-" +
+                           std::to_string(int(shard.mode)));
+      report.numFiles = jobStats.numFiles;
+      report.numFailed = jobStats.numFailed;
+      report.numBytes = jobStats.numBytes;
+      report.seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - startTime)
+                           .count();
+      FinishShardReport(shard,
+                        options.reportFolder.empty()
+                            ? queue.front().path0 + "/.imspike_shards"
+                            : options.reportFolder,
+                        report);
+    }
   }
 
   void Clean() {
-    manager.Wait();
+    WaitFiles();
     scanner.Clear();
     es::Dispose(forEachFile);
     es::Dispose(forEachFolderFinish);
     es::Dispose(forEachFolder);
-    es::Dispose(updateFileCount);
+    es::Dispose(updateWorkload);
+    es::Dispose(workloadDone);
+    es::Dispose(forEachRemoteItem);
+    es::Dispose(forEachRemoteFile);
   }
 
-  BatchQueueImpl(APPContext *ctx_, size_t queueCapacity)
-      : ctx(ctx_), manager(queueCapacity) {
+  BatchQueueImpl(APPContext *ctx_, const BatchOptions &options_,
+                 std::string workerSetup_, size_t queueCapacity)
+      : ctx(ctx_), options(options_), workerSetup(std::move(workerSetup_)),
+        manager(queueCapacity) {
     for (auto &c : ctx->info->filters) {
-      scanner.AddFilter(c);
+      filter.AddFilter(c);
+      queuedInputs.filter.AddFilter(c);
+    }
+
+    // Lease mode balances work dynamically, static shards would only
+    // restrict it
+    if (options.leaseFolder.empty()) {
+      shard.index = std::max(options.shardIndex, 0);
+      shard.count = std::max(options.shardCount, 1);
+      shard.mode = options.shardMode;
     }
+
+    options.leaseChunkSize = std::max(options.leaseChunkSize, 1);
+    options.leaseTimeout = std::max(options.leaseTimeout, 10);
   }
 
   APPContext *ctx;
+  BatchOptions options;
+  // Loads ctx in worker processes, see MakeWorkerContext
+  std::string workerSetup;
   WorkerManager manager{0};
   DirectoryScanner scanner;
+  PathFilter filter;
+  // Copy of filter for workers, scanning thread owns filter
+  QueuedInputs queuedInputs;
+  ShardFilter shard;
+  bool leasedPass = false;
+  // Files of leased chunks still running
+  struct {
+    std::mutex mutex;
+    std::condition_variable chunkDone;
+    std::multimap<std::string, size_t, std::less<>> chunks;
+    std::map<size_t, size_t> numRunning;
+  } leasedFiles;
+  std::unique_ptr<WorkerFarm> farm;
+  struct FarmFile {
+    uint64_t size;
+    uint64_t ticket;
+    ResultCache::Snapshot watched{};
+    bool sampled = false;
+  };
+  std::multimap<std::string, FarmFile> farmFiles;
+  std::unique_ptr<Prefetcher> prefetch;
+  // Temp storage of threads was moved to disk
+  bool ramSpilled = false;
+  // Outputs are recorded, so watch ignores their events
+  bool watching = false;
+  std::map<std::string, ResultCache::FileState, std::less<>> produced;
+  std::mutex producedMutex;
+  std::unique_ptr<ThroughputHistory> throughput;
+  std::unique_ptr<ResultCache> cache;
+  std::unique_ptr<BatchRecorder> recorder;
+  // Only during extract stat pass
+  std::unique_ptr<StatCache> statCache;
+
+  struct {
+    std::atomic_size_t numFiles{0};
+    std::atomic_size_t numFailed{0};
+    std::atomic_uint64_t numBytes{0};
+  } jobStats;
 
   std::function<void(const std::string &path, AppPackStats)> forEachFolder;
   std::function<void()> forEachFolderFinish;
   std::function<void(AppContextShare *)> forEachFile;
-  std::function<void(size_t)> updateFileCount;
+  // Workload is sum of input sizes with FILE_OVERHEAD per file
+  std::function<void(int64_t)> updateWorkload;
+  std::function<void(uint64_t)> workloadDone;
+  // Progress reported by worker processes
+  std::function<void()> forEachRemoteItem;
+  std::function<void(const std::string &path)> forEachRemoteFile;
 };
 
 void PackModeBatch(BatchQueueImpl &batch) {
@@ -245,6 +1308,7 @@ void PackModeBatch(BatchQueueImpl &batch) {
     payload->archiveContext->SendFile(
         iCtx->workingFile.GetFullPath().substr(payload->folderPath.size() + 1),
         iCtx->GetStream());
+
     (*payload->progBar)++;
   };
 
@@ -259,26 +1323,41 @@ std::shared_ptr<ExtractStatsMaker> ExtractStatBatch(BatchQueueImpl &batch) {
   sharedData->scanBar =
       AppendNewLogLine<LoadingBar>("Processing extract stats.");
 
-  batch.forEachFile = [payload = sharedData,
-                       ctx = batch.ctx](AppContextShare *iCtx) {
-    payload->Push(iCtx, ctx->ExtractStat(std::bind(
-                            [&](size_t offset, size_t size) {
-                              return iCtx->GetBuffer(size, offset);
-                            },
-                            std::placeholders::_1, std::placeholders::_2)));
+  batch.forEachFile = [payload = sharedData, ctx = batch.ctx,
+                       statCache = batch.statCache.get()](
+                          AppContextShare *iCtx) {
+    const std::string path(iCtx->FullPath());
+
+    if (auto cached = statCache->Find(path)) {
+      payload->Push(iCtx, *cached);
+      return;
+    }
+
+    InputFile file(path);
+    const size_t numFiles = ctx->ExtractStat(std::bind(
+        [&](size_t offset, size_t size) {
+          return ReadChunk(file, iCtx, offset, size);
+        },
+        std::placeholders::_1, std::placeholders::_2));
+    statCache->Insert(path, numFiles);
+    payload->Push(iCtx, numFiles);
   };
 
   return sharedData;
 }
 
 void ProcessBatch(BatchQueueImpl &batch, ExtractStats *stats) {
-  batch.forEachFile = [payload = std::make_shared<UILines>(*stats),
+  auto payload = std::make_shared<UILines>(*stats);
+  payload->fileLog.summary =
+      batch.options.logVerbosity == LogVerbosity::Summary;
+  batch.forEachFile = [payload = payload,
                        archiveFiles =
                            std::make_shared<decltype(stats->archiveFiles)>(
                                std::move(stats->archiveFiles)),
                        ctx = batch.ctx](AppContextShare *iCtx) {
     auto currentBar = payload->ChooseBar();
     if (currentBar) {
+      currentBar->curitem.store(0, std::memory_order_relaxed);
       currentBar->ItemCount(archiveFiles->at(iCtx->Hash()));
     }
 
@@ -292,36 +1371,67 @@ void ProcessBatch(BatchQueueImpl &batch, ExtractStats *stats) {
       }
     };
 
-    printline("Processing: " << iCtx->FullPath());
+    payload->fileLog.Processing([iCtx] { return iCtx->FullPath(); });
     ctx->ProcessFile(iCtx);
     if (payload->totalProgress) {
       (*payload->totalProgress)++;
     }
   };
+
+  batch.forEachRemoteItem = [payload = payload] {
+    if (payload->totalCount) {
+      (*payload->totalCount)++;
+    }
+  };
+
+  batch.forEachRemoteFile = [payload = payload](const std::string &path) {
+    if (payload->fileLog.summary) {
+      payload->fileLog.Processing([&] { return path; });
+    }
+  };
 }
 
-void ProcessBatch(BatchQueueImpl &batch, size_t numFiles) {
-  auto payload = std::make_shared<UILines>(numFiles);
+void ProcessBatch(BatchQueueImpl &batch) {
+  auto payload = std::make_shared<UILines>();
+  payload->fileLog.summary =
+      batch.options.logVerbosity == LogVerbosity::Summary;
   batch.forEachFile = [payload = payload,
                        ctx = batch.ctx](AppContextShare *iCtx) {
-    printline("Processing: " << iCtx->FullPath());
+    payload->fileLog.Processing([iCtx] { return iCtx->FullPath(); });
     ctx->ProcessFile(iCtx);
-    if (payload->totalProgress) {
-      (*payload->totalProgress)++;
+    if (payload->totalCount) {
+      (*payload->totalCount)++;
     }
+  };
+
+  batch.forEachRemoteFile = [payload = payload](const std::string &path) {
+    if (payload->fileLog.summary) {
+      payload->fileLog.Processing([&] { return path; });
+    }
+
     if (payload->totalCount) {
       (*payload->totalCount)++;
     }
   };
 
-  auto totalFiles = std::make_shared<size_t>(numFiles);
-  batch.updateFileCount = [payload = payload,
-                           totalFiles = totalFiles](size_t addedFiles) {
-    *totalFiles.get() += addedFiles;
-    payload->totalProgress->ItemCount(*totalFiles);
+  batch.workloadDone = [payload = payload](uint64_t workload) {
+    payload->totalProgress->curitem += workload;
+  };
+
+  auto totalWorkload = std::make_shared<int64_t>(0);
+  batch.updateWorkload = [payload = payload,
+                          totalWorkload = totalWorkload](int64_t workload) {
+    *totalWorkload.get() += workload;
+    payload->totalProgress->ItemCount(
+        std::max(*totalWorkload.get(), int64_t(1)));
   };
 }
 
-std::shared_ptr<QueueContext> MakeWorkerContext(APPContext *ctx) {
-  return std::make_shared<BatchQueueImpl>(ctx, ctx->info->multithreaded * 50);
+std::shared_ptr<QueueContext> MakeWorkerContext(APPContext *ctx,
+                                                const BatchOptions &options,
+                                                std::string workerSetup) {
+  return std::make_shared<BatchQueueImpl>(ctx, options, std::move(workerSetup),
+                                          ctx->info->multithreaded * 50);
 }
+
+void InitWorkerProcesses() { StartWorkerZygote(LoadFarmWorker); }
@@ -0,0 +1,274 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "datas/master_printer.hpp"
+#include "imgui.h"
+#include "main.hpp"
+#include "planner.hpp"
+#include "ram_storage.hpp"
+#include <algorithm>
+#include <cstdlib>
+
+BatchOptions batchOptions;
+
+void ParseBatchArgs(const std::vector<std::string> &args,
+                    BatchOptions &options) {
+  for (size_t a = 0; a < args.size(); a++) {
+    auto &arg = args[a];
+    const bool hasValue = a + 1 < args.size();
+
+    if (arg == "--shard" && hasValue) {
+      auto &value = args[++a];
+      if (sscanf(value.c_str(), "%d/%d", &options.shardIndex,
+                 &options.shardCount) != 2 ||
+          options.shardCount < 1 || options.shardIndex < 0 ||
+          options.shardIndex >= options.shardCount) {
+        printerror("Invalid --shard " << value << ", expected i/N");
+        options.shardIndex = 0;
+        options.shardCount = 1;
+      }
+    } else if (arg == "--job" && hasValue) {
+      options.jobName = args[++a];
+    } else if (arg == "--shard-mode" && hasValue) {
+      auto &value = args[++a];
+      if (value == "hash") {
+        options.shardMode = ShardMode::PathHash;
+      } else if (value == "size") {
+        options.shardMode = ShardMode::SizeBalanced;
+      } else {
+        printerror("Invalid --shard-mode " << value << ", expected hash|size");
+      }
+    } else if (arg == "--shard-report" && hasValue) {
+      options.reportFolder = args[++a];
+    } else if (arg == "--lease" && hasValue) {
+      options.leaseFolder = args[++a];
+    } else if (arg == "--lease-chunk" && hasValue) {
+      options.leaseChunkSize = std::max(atoi(args[++a].c_str()), 1);
+    } else if (arg == "--lease-timeout" && hasValue) {
+      options.leaseTimeout = std::max(atoi(args[++a].c_str()), 10);
+    } else if (arg == "--workers" && hasValue) {
+      options.workerProcesses = std::max(atoi(args[++a].c_str()), 0);
+    } else if (arg == "--worker-timeout" && hasValue) {
+      options.workerTimeout = std::max(atoi(args[++a].c_str()), 0);
+    } else if (arg == "--prefetch" && hasValue) {
+      options.prefetchWindow = std::max(atoi(args[++a].c_str()), 0);
+    } else if (arg == "--prefetch-mode" && hasValue) {
+      auto &value = args[++a];
+      if (value == "read") {
+        options.prefetchMode = PrefetchMode::Read;
+      } else if (value == "hint") {
+        options.prefetchMode = PrefetchMode::Hint;
+      } else {
+        printerror("Invalid --prefetch-mode " << value
+                                              << ", expected read|hint");
+      }
+    } else if (arg == "--ram-temp" && hasValue) {
+      options.tempRamLimit = std::max(atoi(args[++a].c_str()), 0);
+    } else if (arg == "--link" && hasValue) {
+      auto &value = args[++a];
+      if (value == "copy") {
+        options.linkPolicy = LinkPolicy::Copy;
+      } else if (value == "reflink") {
+        options.linkPolicy = LinkPolicy::Reflink;
+      } else {
+        printerror("Invalid --link " << value << ", expected copy|reflink");
+      }
+    } else if (arg == "--record" && hasValue) {
+      options.recordFile = args[++a];
+    } else if (arg == "--replay" && hasValue) {
+      options.replayFile = args[++a];
+    } else if (arg == "--replay-folder" && hasValue) {
+      options.replayFolder = args[++a];
+    } else if (arg == "--cache" && hasValue) {
+      options.cacheFolder = args[++a];
+    } else if (arg == "--log" && hasValue) {
+      auto &value = args[++a];
+      if (value == "files") {
+        options.logVerbosity = LogVerbosity::Files;
+      } else if (value == "summary") {
+        options.logVerbosity = LogVerbosity::Summary;
+      } else {
+        printerror("Invalid --log " << value << ", expected files|summary");
+      }
+    }
+  }
+}
+
+static bool InputString(const char *label, std::string &str) {
+  return ImGui::InputText(
+      label, str.data(), str.capacity() + 1,
+      ImGuiInputTextFlags_CallbackResize,
+      [](ImGuiInputTextCallbackData *data) {
+        auto str = static_cast<std::string *>(data->UserData);
+        if (data->EventFlag == ImGuiInputTextFlags_CallbackResize) {
+          str->resize(data->BufTextLen);
+          data->Buf = str->data();
+        }
+        return 0;
+      },
+      &str);
+}
+
+void BatchOptionsUI(BatchOptions &options) {
+  if (!ImGui::CollapsingHeader("Distribution")) {
+    return;
+  }
+
+  ImGui::Indent();
+
+  InputString("Job name", options.jobName);
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Same on every node of a run. Change it to shard or "
+                      "lease the same queue again with same settings.");
+  }
+
+  if (ImGui::InputInt("Shard count", &options.shardCount)) {
+    options.shardCount = std::max(options.shardCount, 1);
+    options.shardIndex =
+        std::clamp(options.shardIndex, 0, options.shardCount - 1);
+  }
+
+  if (ImGui::InputInt("Shard index", &options.shardIndex)) {
+    options.shardIndex =
+        std::clamp(options.shardIndex, 0, options.shardCount - 1);
+  }
+
+  static const char *shardModes[]{"Path hash", "Size balanced"};
+  int shardMode = int(options.shardMode);
+  if (ImGui::Combo("Shard mode", &shardMode, shardModes,
+                   IM_ARRAYSIZE(shardModes))) {
+    options.shardMode = ShardMode(shardMode);
+  }
+
+  InputString("Report folder", options.reportFolder);
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Shared folder for shard reports, defaults to "
+                      ".imspike_shards in queue mount");
+  }
+
+  ImGui::Separator();
+  InputString("Lease folder", options.leaseFolder);
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Shared folder, all instances using it will pull "
+                      "chunks of the same queue. Overrides sharding.");
+  }
+
+  if (ImGui::InputInt("Lease chunk size", &options.leaseChunkSize)) {
+    options.leaseChunkSize = std::max(options.leaseChunkSize, 1);
+  }
+
+  if (ImGui::InputInt("Lease timeout [s]", &options.leaseTimeout)) {
+    options.leaseTimeout = std::max(options.leaseTimeout, 10);
+  }
+
+  ImGui::Separator();
+
+  if (ImGui::InputInt("Worker processes", &options.workerProcesses)) {
+    options.workerProcesses = std::max(options.workerProcesses, 0);
+  }
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Process files in isolated processes, crashing file "
+                      "only restarts its worker. 0 uses threads.");
+  }
+
+  if (ImGui::InputInt("Worker timeout [s]", &options.workerTimeout)) {
+    options.workerTimeout = std::max(options.workerTimeout, 0);
+  }
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Worker process stuck on single file for longer is "
+                      "killed and restarted, file fails. 0 disables it.");
+  }
+
+  if (ImGui::InputInt("Prefetch window (MiB)", &options.prefetchWindow)) {
+    options.prefetchWindow = std::max(options.prefetchWindow, 0);
+  }
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Read next inputs ahead of workers, helps with slow or "
+                      "network storage. 0 disables it.");
+  }
+
+  static const char *prefetchModes[]{"Read data", "Read-ahead hints"};
+  int prefetchMode = int(options.prefetchMode);
+  if (ImGui::Combo("Prefetch mode", &prefetchMode, prefetchModes,
+                   IM_ARRAYSIZE(prefetchModes))) {
+    options.prefetchMode = PrefetchMode(prefetchMode);
+  }
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Hints only ask local disks to read ahead, reading data "
+                      "works with network storage as well.");
+  }
+
+  if (ImGui::InputInt("RAM temp storage (MiB)", &options.tempRamLimit)) {
+    options.tempRamLimit = std::max(options.tempRamLimit, 0);
+  }
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Keep intermediate files in RAM. Beyond this size new "
+                      "files keep them on disk. 0 disables it. Applied after "
+                      "restart.");
+  }
+
+  if (auto usage = RamStorageStatus(); usage.active) {
+    char usageBuffer[64]{};
+    snprintf(usageBuffer, sizeof(usageBuffer), "%s / %s%s",
+             FormatBytes(usage.used).c_str(), FormatBytes(usage.limit).c_str(),
+             usage.full ? ", spilling to disk" : "");
+    ImGui::ProgressBar(usage.limit ? float(usage.used) / usage.limit : 0,
+                       {-1, 0}, usageBuffer);
+  }
+
+  InputString("Result cache folder", options.cacheFolder);
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Outputs of inputs with same contents and settings are "
+                      "copied from here instead of processing them again.");
+  }
+
+  static const char *linkPolicies[]{"Copy", "Reflink"};
+  int linkPolicy = int(options.linkPolicy);
+  if (ImGui::Combo("Cached outputs", &linkPolicy, linkPolicies,
+                   IM_ARRAYSIZE(linkPolicies))) {
+    options.linkPolicy = LinkPolicy(linkPolicy);
+  }
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Reflinks share data with cache without copying it, "
+                      "where filesystem supports them.");
+  }
+
+  InputString("Record run to", options.recordFile);
+
+  if (ImGui::IsItemHovered()) {
+    ImGui::SetTooltip("Stores file list, sizes and timings of next run, "
+                      "replay it with --replay file --replay-folder folder");
+  }
+
+  static const char *logModes[]{"Every file", "Summary"};
+  int logMode = int(options.logVerbosity);
+  if (ImGui::Combo("File log", &logMode, logModes, IM_ARRAYSIZE(logModes))) {
+    options.logVerbosity = LogVerbosity(logMode);
+  }
+
+  ImGui::Unindent();
+}
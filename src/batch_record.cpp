@@ -0,0 +1,259 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "batch_record.hpp"
+#include "dir_cache.hpp"
+#include "datas/master_printer.hpp"
+#include "datas/pugiex.hpp"
+#include "planner.hpp"
+#include "spike/context.hpp"
+#include "worker_farm.hpp"
+#include <algorithm>
+#include <cinttypes>
+#include <filesystem>
+#include <map>
+
+namespace fs = std::filesystem;
+
+BatchRecorder::BatchRecorder(std::string_view module_, uint64_t settingsHash_,
+                             const BatchOptions &options, size_t numThreads_)
+    : module(module_), settingsHash(settingsHash_),
+      workerProcesses(options.workerProcesses), numThreads(numThreads_) {}
+
+void BatchRecorder::Add(std::string_view path, uint64_t size, double seconds,
+                        bool succeeded) {
+  const double finished =
+      std::chrono::duration<double>(clock::now() - startTime).count();
+  std::lock_guard<std::mutex> lg(filesMutex);
+  files.push_back({std::string(path), size, std::max(finished - seconds, 0.0),
+                   seconds, succeeded});
+}
+
+void BatchRecorder::Save(const std::string &path) {
+  std::lock_guard<std::mutex> lg(filesMutex);
+  const double runSeconds =
+      std::chrono::duration<double>(clock::now() - startTime).count();
+  std::sort(files.begin(), files.end(),
+            [](auto &f0, auto &f1) { return f0.start < f1.start; });
+
+  // Keys are made relative to common folder, replay recreates them elsewhere
+  size_t prefixSize = 0;
+
+  if (!files.empty()) {
+    std::string_view prefix(files.front().key);
+    prefix = prefix.substr(0, prefix.find_last_of("/\\") + 1);
+
+    for (auto &f : files) {
+      while (!std::string_view(f.key).starts_with(prefix)) {
+        prefix.remove_suffix(1);
+        prefix = prefix.substr(0, prefix.find_last_of("/\\") + 1);
+      }
+    }
+
+    prefixSize = prefix.size();
+  }
+
+  pugi::xml_document doc;
+  auto root = doc.append_child("batch_record");
+  root.append_attribute("module").set_value(module.c_str());
+  char hashBuffer[32]{};
+  snprintf(hashBuffer, sizeof(hashBuffer), "%016" PRIx64, settingsHash);
+  root.append_attribute("settings_hash").set_value(hashBuffer);
+  root.append_attribute("threads").set_value(numThreads);
+  root.append_attribute("worker_processes").set_value(workerProcesses);
+  root.append_attribute("seconds").set_value(runSeconds);
+
+  for (auto &f : files) {
+    auto node = root.append_child("file");
+    node.append_attribute("key").set_value(f.key.c_str() + prefixSize);
+    node.append_attribute("size").set_value(f.size);
+    node.append_attribute("start").set_value(f.start);
+    node.append_attribute("seconds").set_value(f.seconds);
+
+    if (!f.succeeded) {
+      node.append_attribute("failed").set_value(true);
+    }
+  }
+
+  try {
+    XMLToFile(path, doc);
+    printinfo("Recorded " << files.size() << " files into " << path);
+  } catch (const std::exception &e) {
+    printerror("Cannot save batch record " << path << ": " << e.what());
+  }
+}
+
+// Recorded time of every synthetic file, fixed before replay starts
+static std::map<std::string, double, std::less<>> replayTimes;
+static AppInfo_s replayInfo{};
+
+static void ReplayProcessFile(AppContextShare *ctx) {
+  const auto startTime = std::chrono::steady_clock::now();
+  const std::string path(ctx->FullPath());
+  auto found = replayTimes.find(path);
+  const double seconds = found == replayTimes.end() ? 0 : found->second;
+
+  ctx->GetBuffer();
+
+  // Busy, modules are mostly bound by CPU
+  const auto deadline =
+      startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                      std::chrono::duration<double>(seconds));
+  while (std::chrono::steady_clock::now() < deadline) {
+  }
+}
+
+static APPContext ReplayContext() {
+  replayInfo.header = "ImSpike replay";
+  APPContext replayCtx;
+  replayCtx.info = &replayInfo;
+  replayCtx.ProcessFile = ReplayProcessFile;
+
+  return replayCtx;
+}
+
+// Synthetic files are made by ReplayBatch, only their times are loaded
+APPContext LoadReplayWorker(std::string_view setup) {
+  const std::string recordPath(TakeSetupField(setup));
+  const fs::path folder(TakeSetupField(setup));
+  pugi::xml_document doc = XMLFromFile(recordPath);
+
+  for (auto node : doc.child("batch_record").children("file")) {
+    replayTimes.emplace((folder / node.attribute("key").as_string()).string(),
+                        node.attribute("seconds").as_double());
+  }
+
+  return ReplayContext();
+}
+
+static bool MakeSyntheticFile(const fs::path &path, uint64_t size,
+                              const std::vector<char> &pattern,
+                              DirectoryCache &folders) {
+  std::error_code ec;
+
+  if (fs::file_size(path, ec) == size && !ec) {
+    return true;
+  }
+
+  folders.Create(path.parent_path());
+  FILE *file = fopen(path.string().c_str(), "wb");
+
+  if (!file) {
+    return false;
+  }
+
+  for (uint64_t written = 0; written < size;) {
+    const size_t chunk = std::min(uint64_t(pattern.size()), size - written);
+    fwrite(pattern.data(), 1, chunk, file);
+    written += chunk;
+  }
+
+  fclose(file);
+  return true;
+}
+
+int ReplayBatch(const std::string &recordPath, const std::string &folder,
+                const BatchOptions &options) {
+  pugi::xml_document doc;
+
+  try {
+    doc = XMLFromFile(recordPath);
+  } catch (const std::exception &e) {
+    printerror("Cannot load batch record " << recordPath << ": " << e.what());
+    return 1;
+  }
+
+  auto root = doc.child("batch_record");
+  std::vector<RecordedFile> files;
+  uint64_t numBytes = 0;
+
+  for (auto node : root.children("file")) {
+    RecordedFile file;
+    file.key = node.attribute("key").as_string();
+    file.size = node.attribute("size").as_ullong();
+    file.start = node.attribute("start").as_double();
+    file.seconds = node.attribute("seconds").as_double();
+    file.succeeded = !node.attribute("failed").as_bool();
+    numBytes += file.size;
+    files.emplace_back(std::move(file));
+  }
+
+  printinfo("Replaying " << files.size() << " files, "
+                         << FormatBytes(numBytes) << " recorded with "
+                         << root.attribute("module").as_string() << ", "
+                         << root.attribute("threads").as_uint()
+                         << " threads and "
+                         << root.attribute("worker_processes").as_int()
+                         << " worker processes.");
+
+  // Incompressible, so storage cannot shortcut reads
+  std::vector<char> pattern(1 << 20);
+  uint64_t seed = 0x9e3779b97f4a7c15;
+
+  for (auto &c : pattern) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    c = char(seed);
+  }
+
+  DirectoryCache folders;
+
+  for (auto &f : files) {
+    const fs::path path = fs::path(folder) / f.key;
+
+    if (!MakeSyntheticFile(path, f.size, pattern, folders)) {
+      printerror("Cannot create synthetic file " << path.string());
+      return 1;
+    }
+
+    replayTimes.emplace(path.string(), f.seconds);
+  }
+
+  folders.PrintSavings("Replay");
+
+  replayInfo.multithreaded = root.attribute("threads").as_uint() > 1;
+  APPContext replayCtx = ReplayContext();
+
+  // Measure engine and storage only
+  BatchOptions replayOptions = options;
+  replayOptions.shardCount = 1;
+  replayOptions.shardIndex = 0;
+  replayOptions.leaseFolder.clear();
+  replayOptions.cacheFolder.clear();
+
+  std::string workerSetup(1, WORKER_SETUP_REPLAY);
+  AppendSetupField(workerSetup, recordPath);
+  AppendSetupField(workerSetup, folder);
+  auto batch = MakeWorkerContext(&replayCtx, replayOptions, workerSetup);
+
+  for (auto &f : files) {
+    batch->queue.push_back({.path0 = folder, .path1 = f.key});
+  }
+
+  const auto startTime = std::chrono::steady_clock::now();
+  batch->ProcessQueue();
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - startTime)
+                             .count();
+
+  printinfo("Replay took " << FormatDuration(seconds) << " (" << seconds
+                           << "s), recorded run took "
+                           << root.attribute("seconds").as_double() << "s.");
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "main.hpp"
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct RecordedFile {
+  // Path relative to common folder of recorded run
+  std::string key;
+  uint64_t size = 0;
+  // Seconds since start of run
+  double start = 0;
+  double seconds = 0;
+  bool succeeded = true;
+};
+
+// Captures processing pass, so it can be replayed without original data
+// and module.
+class BatchRecorder {
+public:
+  BatchRecorder(std::string_view module, uint64_t settingsHash,
+                const BatchOptions &options, size_t numThreads);
+
+  // Thread safe, called when file is finished
+  void Add(std::string_view path, uint64_t size, double seconds,
+           bool succeeded);
+  void Save(const std::string &path);
+
+private:
+  using clock = std::chrono::steady_clock;
+  std::string module;
+  uint64_t settingsHash;
+  int workerProcesses;
+  size_t numThreads;
+  clock::time_point startTime = clock::now();
+  std::vector<RecordedFile> files;
+  std::mutex filesMutex;
+};
+
+// Creates files of recorded sizes inside folder and processes them with
+// synthetic module, that reads every file and then spins for its recorded
+// time. Returns process exit code.
+int ReplayBatch(const std::string &recordPath, const std::string &folder,
+                const BatchOptions &options);
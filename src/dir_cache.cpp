@@ -0,0 +1,74 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "dir_cache.hpp"
+#include "datas/master_printer.hpp"
+#include <mutex>
+
+namespace fs = std::filesystem;
+
+bool DirectoryCache::Known(const std::string &folder) const {
+  std::shared_lock<std::shared_mutex> lg(mutex);
+  return folders.contains(folder);
+}
+
+bool DirectoryCache::Create(const fs::path &folder) {
+  const fs::path normal = folder.lexically_normal();
+  std::string key = normal.generic_string();
+
+  while (key.size() > 1 && key.back() == '/') {
+    key.pop_back();
+  }
+
+  if (key.empty() || key == "/" || key == ".") {
+    return true;
+  }
+
+  if (Known(key)) {
+    numSkipped++;
+    return true;
+  }
+
+  // Parents first, so mkdir of this folder is single call
+  if (normal.has_relative_path() && normal.parent_path() != normal &&
+      !Create(normal.parent_path())) {
+    return false;
+  }
+
+  std::error_code ec;
+  numCalls++;
+  fs::create_directory(normal, ec);
+
+  if (ec) {
+    return false;
+  }
+
+  std::unique_lock<std::shared_mutex> lg(mutex);
+  folders.emplace(std::move(key));
+  return true;
+}
+
+void DirectoryCache::PrintSavings(const char *owner) const {
+  if (!numSkipped) {
+    return;
+  }
+
+  std::shared_lock<std::shared_mutex> lg(mutex);
+  printinfo(owner << " made " << folders.size() << " folders with "
+                  << numCalls << " filesystem calls, skipped " << numSkipped
+                  << " folder lookups.");
+}
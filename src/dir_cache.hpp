@@ -0,0 +1,46 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <shared_mutex>
+#include <string>
+#include <unordered_set>
+
+// Folders made during a job, shared by every worker. Each folder is made
+// with a single mkdir at most once, instead of stat and mkdir of whole
+// chain whenever a file is written into it.
+// Covers only folders ImSpike writes into itself: outputs restored from
+// result cache, its blob store and replayed outputs. Output folders of
+// modules are made by precore output contexts, outside of this cache.
+class DirectoryCache {
+public:
+  // Thread safe create_directories, false on error
+  bool Create(const std::filesystem::path &folder);
+  // Logs number of skipped filesystem calls
+  void PrintSavings(const char *owner) const;
+
+private:
+  std::unordered_set<std::string> folders;
+  mutable std::shared_mutex mutex;
+  std::atomic_uint64_t numCalls{0};
+  std::atomic_uint64_t numSkipped{0};
+
+  bool Known(const std::string &folder) const;
+};
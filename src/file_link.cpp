@@ -0,0 +1,70 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "file_link.hpp"
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+#ifndef USEWIN
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+static bool Reflink(const std::string &src, const std::string &dst) {
+  const int srcFd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (srcFd < 0) {
+    return false;
+  }
+
+  const int dstFd =
+      open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+  if (dstFd < 0) {
+    close(srcFd);
+    return false;
+  }
+
+  const bool cloned = !ioctl(dstFd, FICLONE, srcFd);
+  close(dstFd);
+  close(srcFd);
+
+  if (!cloned) {
+    unlink(dst.c_str());
+  }
+
+  return cloned;
+}
+#else
+static bool Reflink(const std::string &, const std::string &) {
+  return false;
+}
+#endif
+
+LinkResult Materialize(const std::string &src, const std::string &dst,
+                       LinkPolicy policy) {
+  if (policy != LinkPolicy::Copy && Reflink(src, dst)) {
+    return LinkResult::Reflinked;
+  }
+
+  std::error_code ec;
+  fs::copy_file(src, dst, fs::copy_options::overwrite_existing, ec);
+
+  return ec ? LinkResult::Failed : LinkResult::Copied;
+}
@@ -0,0 +1,32 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "main.hpp"
+#include <string>
+
+enum class LinkResult {
+  Failed,
+  Copied,
+  Reflinked,
+};
+
+// Makes dst with contents of src, overwriting it. By policy, extents are
+// shared through reflink (FICLONE) before falling back to copy.
+// Files are never hardlinked, rewriting one in place would change other.
+LinkResult Materialize(const std::string &src, const std::string &dst,
+                       LinkPolicy policy);
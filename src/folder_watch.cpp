@@ -0,0 +1,207 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "folder_watch.hpp"
+#include "datas/master_printer.hpp"
+#include <algorithm>
+#include <filesystem>
+
+#ifdef USEWIN
+FolderWatch::FolderWatch() {}
+FolderWatch::~FolderWatch() {}
+void FolderWatch::AddFolder(const std::string &, bool) {}
+
+std::vector<std::string> FolderWatch::Wait(std::chrono::milliseconds,
+                                           const std::atomic_bool &) {
+  return {};
+}
+#else
+#include <cstring>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Written files are reported on close, so partially written files are
+// never picked up.
+static constexpr uint32_t FILE_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO;
+static constexpr uint32_t FOLDER_EVENTS = IN_CREATE | IN_MOVED_TO;
+// Bursts of events are merged up to this long
+static constexpr auto MAX_DEBOUNCE = std::chrono::seconds(10);
+
+FolderWatch::FolderWatch() {
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (fd < 0) {
+    printerror("Cannot initialize inotify: " << strerror(errno));
+  }
+}
+
+FolderWatch::~FolderWatch() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void FolderWatch::AddFolder(const std::string &path, bool recursive) {
+  roots.push_back({path, recursive});
+  AddWatch(path, recursive, nullptr);
+}
+
+void FolderWatch::AddWatch(const std::string &path, bool recursive,
+                           std::vector<std::string> *changed) {
+  if (fd < 0) {
+    return;
+  }
+
+  const int wd = inotify_add_watch(
+      fd, path.c_str(), FILE_EVENTS | (recursive ? FOLDER_EVENTS : 0));
+
+  if (wd < 0) {
+    printerror("Cannot watch " << path << ": " << strerror(errno));
+    return;
+  }
+
+  watches[wd] = {path, recursive};
+
+  if (!recursive) {
+    return;
+  }
+
+  std::error_code ec;
+
+  for (auto &e : fs::directory_iterator(path, ec)) {
+    if (e.is_directory(ec)) {
+      AddWatch(e.path().string(), true, changed);
+    } else if (changed && e.is_regular_file(ec)) {
+      // Created before watch was set up
+      changed->push_back(e.path().string());
+    }
+  }
+}
+
+bool FolderWatch::ReadEvents(std::vector<std::string> &changed) {
+  alignas(inotify_event) char buffer[0x10000];
+  bool anyEvent = false;
+
+  for (;;) {
+    const ssize_t numRead = read(fd, buffer, sizeof(buffer));
+
+    if (numRead <= 0) {
+      return anyEvent;
+    }
+
+    for (char *cursor = buffer; cursor < buffer + numRead;) {
+      auto event = reinterpret_cast<inotify_event *>(cursor);
+      cursor += sizeof(inotify_event) + event->len;
+      anyEvent = true;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        printwarning("Watch events were lost, rescanning watched folders.");
+
+        for (auto &r : roots) {
+          std::error_code ec;
+
+          if (r.recursive) {
+            for (auto &e : fs::recursive_directory_iterator(r.path, ec)) {
+              if (e.is_regular_file(ec)) {
+                changed.push_back(e.path().string());
+              }
+            }
+          } else {
+            for (auto &e : fs::directory_iterator(r.path, ec)) {
+              if (e.is_regular_file(ec)) {
+                changed.push_back(e.path().string());
+              }
+            }
+          }
+        }
+
+        continue;
+      }
+
+      if (event->mask & IN_IGNORED) {
+        watches.erase(event->wd);
+        continue;
+      }
+
+      auto found = watches.find(event->wd);
+
+      if (found == watches.end() || !event->len) {
+        continue;
+      }
+
+      std::string path = found->second.path + "/" + event->name;
+
+      if (event->mask & IN_ISDIR) {
+        if (found->second.recursive) {
+          AddWatch(path, true, &changed);
+        }
+      } else if (event->mask & FILE_EVENTS) {
+        changed.push_back(std::move(path));
+      }
+    }
+  }
+}
+
+std::vector<std::string> FolderWatch::Wait(std::chrono::milliseconds debounce,
+                                           const std::atomic_bool &stop) {
+  std::vector<std::string> changed;
+
+  if (fd < 0) {
+    return changed;
+  }
+
+  using clock = std::chrono::steady_clock;
+  clock::time_point firstEvent;
+  clock::time_point lastEvent;
+  pollfd pfd{fd, POLLIN, 0};
+
+  while (!stop) {
+    const auto now = clock::now();
+
+    if (!changed.empty() &&
+        (now - lastEvent >= debounce || now - firstEvent >= MAX_DEBOUNCE)) {
+      break;
+    }
+
+    // Short timeout, so stop is noticed
+    if (poll(&pfd, 1, 200) > 0 && ReadEvents(changed)) {
+      lastEvent = clock::now();
+
+      if (firstEvent == clock::time_point{} && !changed.empty()) {
+        firstEvent = lastEvent;
+      }
+    }
+  }
+
+  if (stop) {
+    return {};
+  }
+
+  std::sort(changed.begin(), changed.end());
+  changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+  // Temporary files renamed or removed within debounce
+  std::erase_if(changed, [](auto &path) {
+    std::error_code ec;
+    return !fs::is_regular_file(path, ec);
+  });
+
+  return changed;
+}
+#endif
@@ -0,0 +1,56 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// Reports files that were completely written or moved into watched folders.
+// Only implemented with inotify.
+class FolderWatch {
+public:
+  FolderWatch();
+  ~FolderWatch();
+  FolderWatch(const FolderWatch &) = delete;
+  FolderWatch &operator=(const FolderWatch &) = delete;
+
+  bool Supported() const { return fd >= 0; }
+  // Subfolders are watched as well, including ones created later
+  void AddFolder(const std::string &path, bool recursive);
+  // Blocks until some files change and no further change comes within
+  // debounce. Returns sorted unique paths, empty when stop is set.
+  std::vector<std::string> Wait(std::chrono::milliseconds debounce,
+                                const std::atomic_bool &stop);
+
+private:
+  struct Watch {
+    std::string path;
+    bool recursive;
+  };
+
+  int fd = -1;
+  std::map<int, Watch> watches;
+  std::vector<Watch> roots;
+
+  // Files already present in new folder are added to changed
+  void AddWatch(const std::string &path, bool recursive,
+                std::vector<std::string> *changed);
+  bool ReadEvents(std::vector<std::string> &changed);
+};
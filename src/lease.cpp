@@ -0,0 +1,305 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "lease.hpp"
+#include "datas/master_printer.hpp"
+#include "shard.hpp"
+#include <algorithm>
+#include <cstdio>
+
+namespace fs = std::filesystem;
+
+static bool WriteNodeFile(const std::string &path, const std::string &node,
+                          const char *mode) {
+  FILE *file = fopen(path.c_str(), mode);
+
+  if (!file) {
+    return false;
+  }
+
+  fwrite(node.data(), 1, node.size(), file);
+  fclose(file);
+  return true;
+}
+
+static std::string ReadNodeFile(const std::string &path) {
+  char buffer[512]{};
+  FILE *file = fopen(path.c_str(), "rb");
+
+  if (!file) {
+    return {};
+  }
+
+  const size_t numRead = fread(buffer, 1, sizeof(buffer) - 1, file);
+  fclose(file);
+  return std::string(buffer, numRead);
+}
+
+LeaseBoard::LeaseBoard(std::string folder_, size_t numChunks_,
+                       std::chrono::seconds timeout_)
+    : folder(std::move(folder_)), nodeName(NodeName()),
+      numChunks(numChunks_), timeout(timeout_), finished(numChunks_) {
+  fs::create_directories(folder);
+  // Spread nodes over the job, so they don't compete for the same chunks
+  startChunk = numChunks ? PathHash(nodeName) % numChunks : 0;
+  heartbeat = std::thread([this] { Heartbeat(); });
+}
+
+LeaseBoard::~LeaseBoard() {
+  {
+    std::lock_guard<std::mutex> lg(heldMutex);
+    stopping = true;
+  }
+
+  heartbeatSignal.notify_all();
+  heartbeat.join();
+  held.clear();
+
+  std::error_code ec;
+  fs::remove(folder + "/clock-" + nodeName, ec);
+}
+
+std::string LeaseBoard::ChunkPath(size_t chunk, const char *ext) const {
+  return folder + "/chunk-" + std::to_string(chunk) + ext;
+}
+
+fs::file_time_type LeaseBoard::ServerNow() const {
+  const std::string probePath = folder + "/clock-" + nodeName;
+  WriteNodeFile(probePath, nodeName, "wb");
+  std::error_code ec;
+  auto retVal = fs::last_write_time(probePath, ec);
+  return ec ? fs::file_time_type::clock::now() : retVal;
+}
+
+bool LeaseBoard::IsDone(size_t chunk) {
+  if (finished[chunk]) {
+    return true;
+  }
+
+  std::error_code ec;
+  if (fs::exists(ChunkPath(chunk, ".done"), ec)) {
+    finished[chunk] = true;
+
+    if (foreignDone) {
+      foreignDone(chunk);
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+// Puts lease renamed away back, unless new lease was made in the meantime
+static void RestoreLease(const std::string &movedPath,
+                         const std::string &leasePath) {
+  std::error_code ec;
+  // Unlike rename, linking never replaces existing lease
+  fs::create_hard_link(movedPath, leasePath, ec);
+  fs::remove(movedPath, ec);
+}
+
+bool LeaseBoard::TryAcquire(size_t chunk, bool allowTakeover) {
+  const std::string leasePath = ChunkPath(chunk, ".lease");
+
+  if (FILE *file = fopen(leasePath.c_str(), "wbx")) {
+    fwrite(nodeName.data(), 1, nodeName.size(), file);
+    fflush(file);
+
+    // Chunk might have been finished right before we got the lease
+    if (IsDone(chunk)) {
+      fclose(file);
+      std::error_code ec;
+      fs::remove(leasePath, ec);
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lg(heldMutex);
+    held.emplace(chunk, std::shared_ptr<FILE>(file, fclose));
+    lost.erase(chunk);
+    return true;
+  }
+
+  if (!allowTakeover) {
+    return false;
+  }
+
+  std::error_code ec;
+  const std::string holder = ReadNodeFile(leasePath);
+  auto leaseTime = fs::last_write_time(leasePath, ec);
+
+  if (ec) {
+    // Lease was released in the meantime
+    return TryAcquire(chunk, false);
+  }
+
+  if (ServerNow() - leaseTime < timeout) {
+    return false;
+  }
+
+  // Only one process can succeed in renaming expired lease away
+  const std::string stalePath = leasePath + ".stale-" + nodeName;
+  fs::rename(leasePath, stalePath, ec);
+
+  if (ec) {
+    return false;
+  }
+
+  // Holder might have refreshed it between the check and the rename
+  auto staleTime = fs::last_write_time(stalePath, ec);
+
+  if (ec || staleTime != leaseTime || ReadNodeFile(stalePath) != holder) {
+    RestoreLease(stalePath, leasePath);
+    return false;
+  }
+
+  printwarning("Taking over expired lease of chunk " << chunk << " held by "
+                                                     << holder);
+  fs::remove(stalePath, ec);
+
+  return TryAcquire(chunk, false);
+}
+
+void LeaseBoard::Release(size_t chunk) {
+  const std::string leasePath = ChunkPath(chunk, ".lease");
+  const std::string releasePath = leasePath + ".release-" + nodeName;
+  std::error_code ec;
+  fs::rename(leasePath, releasePath, ec);
+
+  if (ec) {
+    return;
+  }
+
+  if (ReadNodeFile(releasePath) == nodeName) {
+    fs::remove(releasePath, ec);
+  } else {
+    RestoreLease(releasePath, leasePath);
+  }
+}
+
+bool LeaseBoard::Owns(size_t chunk) {
+  std::lock_guard<std::mutex> lg(heldMutex);
+  return held.contains(chunk) && !lost.contains(chunk);
+}
+
+size_t LeaseBoard::NumDone() {
+  size_t numDone = 0;
+
+  for (size_t c = 0; c < numChunks; c++) {
+    numDone += IsDone(c);
+  }
+
+  return numDone;
+}
+
+std::optional<size_t> LeaseBoard::Claim() {
+  for (;;) {
+    bool pending = false;
+
+    for (size_t c = 0; c < numChunks; c++) {
+      const size_t chunk = (startChunk + c) % numChunks;
+
+      if (IsDone(chunk)) {
+        continue;
+      }
+
+      if (TryAcquire(chunk, true)) {
+        startChunk = chunk + 1;
+        return chunk;
+      }
+
+      pending = true;
+    }
+
+    if (!pending) {
+      return std::nullopt;
+    }
+
+    // Everything left is leased, wait for others to finish or expire
+    std::this_thread::sleep_for(
+        std::clamp(timeout / 4, std::chrono::seconds(1),
+                   std::chrono::seconds(10)));
+  }
+}
+
+void LeaseBoard::Complete(size_t chunk) {
+  bool owned = false;
+
+  {
+    std::lock_guard<std::mutex> lg(heldMutex);
+    auto found = held.find(chunk);
+
+    if (found != held.end()) {
+      held.erase(found);
+      owned = !lost.erase(chunk);
+    }
+  }
+
+  // New owner processes it again and marks it
+  if (owned) {
+    WriteNodeFile(ChunkPath(chunk, ".done"), nodeName, "wb");
+    finished[chunk] = true;
+  }
+
+  Release(chunk);
+}
+
+void LeaseBoard::Heartbeat() {
+  std::unique_lock<std::mutex> lk(heldMutex);
+
+  while (!heartbeatSignal.wait_for(lk, timeout / 3,
+                                   [&] { return stopping; })) {
+    std::vector<std::pair<size_t, std::shared_ptr<FILE>>> refresh;
+
+    for (auto &[chunk, file] : held) {
+      if (!lost.contains(chunk)) {
+        refresh.emplace_back(chunk, file);
+      }
+    }
+
+    lk.unlock();
+    std::vector<size_t> takenOver;
+
+    for (auto &[chunk, file] : refresh) {
+      if (ReadNodeFile(ChunkPath(chunk, ".lease")) != nodeName) {
+        takenOver.push_back(chunk);
+        continue;
+      }
+
+      // Rewrite instead of touch, so mtime is set by file server.
+      // Handle still refers to our lease, even if it was renamed away.
+      fseek(file.get(), 0, SEEK_SET);
+      fwrite(nodeName.data(), 1, nodeName.size(), file.get());
+      fflush(file.get());
+    }
+
+    refresh.clear();
+    lk.lock();
+
+    for (size_t chunk : takenOver) {
+      // Completed and released meanwhile
+      if (!held.contains(chunk)) {
+        continue;
+      }
+
+      printwarning("Lease of chunk " << chunk
+                                     << " was taken over by other node, "
+                                        "leaving it.");
+      lost.insert(chunk);
+    }
+  }
+}
@@ -0,0 +1,86 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Job split into chunks, which are pulled by any number of processes
+// sharing the lease folder.
+// Chunk is owned through exclusively created <chunk>.lease file, that is
+// kept alive by heartbeat writing through handle kept open since creation,
+// so it never touches lease made by other process. Lease that was not
+// refreshed within timeout is taken over by another process. Finished chunk
+// is marked by <chunk>.done.
+// Ages are measured against mtime of a probe file, so clocks of nodes
+// don't have to be in sync with the file server.
+class LeaseBoard {
+public:
+  LeaseBoard(std::string folder, size_t numChunks,
+             std::chrono::seconds timeout);
+  ~LeaseBoard();
+
+  // Blocks while all remaining chunks are leased by others.
+  // Returns nothing once every chunk is done.
+  std::optional<size_t> Claim();
+  // False once lease of claimed chunk was taken over, chunk should be left
+  bool Owns(size_t chunk);
+  // Marks owned chunk as done, releases lease of lost one
+  void Complete(size_t chunk);
+  // Number of chunks already done
+  size_t NumDone();
+
+  // Called for chunks found finished by other processes
+  std::function<void(size_t chunk)> foreignDone;
+
+private:
+  std::string folder;
+  std::string nodeName;
+  size_t numChunks;
+  size_t startChunk;
+  std::chrono::seconds timeout;
+  std::vector<bool> finished;
+
+  // Guards held and lost only, heartbeat does its I/O without it, so
+  // Owns is never blocked by file server. Handles stay open while heartbeat
+  // still writes through them.
+  std::mutex heldMutex;
+  std::map<size_t, std::shared_ptr<FILE>> held;
+  std::set<size_t> lost;
+  std::condition_variable heartbeatSignal;
+  bool stopping = false;
+  std::thread heartbeat;
+
+  std::string ChunkPath(size_t chunk, const char *ext) const;
+  bool IsDone(size_t chunk);
+  bool TryAcquire(size_t chunk, bool allowTakeover);
+  // Removes lease, unless it belongs to other process
+  void Release(size_t chunk);
+  std::filesystem::file_time_type ServerNow() const;
+  void Heartbeat();
+};
@@ -20,16 +20,29 @@
 #include "imgui.h"
 #include <algorithm>
 #include <atomic>
+#include <string_view>
 #include <vector>
 
 static std::vector<es::print::Queuer> logLines;
 static std::vector<es::print::Queuer> messageQueues[2];
 static std::atomic<bool> messageQueueOrder;
 
+static void (*logForwarder)(int type, std::string_view payload) = nullptr;
+
 void ReceiveQueue(const es::print::Queuer &que) {
+  if (logForwarder) {
+    logForwarder(int(que.type),
+                 std::string_view(que.payload.data(), que.payload.size()));
+    return;
+  }
+
   messageQueues[messageQueueOrder].push_back(que);
 }
 
+void ForwardLogs(void (*forward)(int type, std::string_view payload)) {
+  logForwarder = forward;
+}
+
 void InitLogs() { es::print::AddQueuer(ReceiveQueue); }
 
 void Logs() {
@@ -34,9 +34,12 @@
 #include "spike/context.hpp"
 #include "spike/tmp_storage.hpp"
 
+#include "batch_record.hpp"
 #include "font_awesome4/definitions.h"
 #include "main.hpp"
 #include "project.h"
+#include "ram_storage.hpp"
+#include "temp_cleanup.hpp"
 
 namespace ImGui {
 bool Link(const char *label, ImGuiButtonFlags flags = 0) {
@@ -139,14 +142,6 @@ void WarmColors() {
 int _tmain(int argc, TCHAR *argv[]) {
   InitLogs();
   es::print::AddPrinterFunction(es::Print);
-  CleanTempStorages();
-  InitTempStorage();
-  auto modules = CreateModulesContext(std::to_string(argv[0]));
-
-  glfwInit();
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
   pugi::xml_document settingsDoc;
   try {
@@ -156,6 +151,46 @@ int _tmain(int argc, TCHAR *argv[]) {
 
   GLFWState gstate;
   LoadSettings(gstate, settingsDoc);
+  LoadSettings(batchOptions, settingsDoc);
+  const BatchOptions loadedOptions = batchOptions;
+
+  {
+    std::vector<std::string> args;
+
+    for (int a = 1; a < argc; a++) {
+      args.emplace_back(std::to_string(argv[a]));
+    }
+
+    ParseBatchArgs(args, batchOptions);
+  }
+
+  const BatchOptions overriddenOptions = batchOptions;
+
+  // Before modules are loaded, so they pick up temp folder
+  InitRamStorage(uint64_t(batchOptions.tempRamLimit) << 20);
+  InitTempFolder();
+  // Workers are forked from it, so it's forked before any thread is started
+  InitWorkerProcesses();
+  StartTempStorageCleanup();
+  auto modules = CreateModulesContext(std::to_string(argv[0]));
+
+  glfwInit();
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+  if (!batchOptions.replayFile.empty()) {
+    glfwTerminate();
+    const int result = ReplayBatch(batchOptions.replayFile,
+                                   batchOptions.replayFolder.empty()
+                                       ? "replay"
+                                       : batchOptions.replayFolder,
+                                   batchOptions);
+    CleanCurrentTempStorage();
+    FinishTempStorageCleanup();
+    CleanRamStorage();
+    return result;
+  }
 
   GLFWwindow *window = glfwCreateWindow(gstate.width, gstate.height,
                                         ImSpike_PRODUCT_NAME, nullptr, nullptr);
@@ -211,6 +246,8 @@ int _tmain(int argc, TCHAR *argv[]) {
     if (g->IO.WantSaveIniSettings) {
       glfwGetWindowSize(window, &gstate.width, &gstate.height);
       SaveSettings(gstate, *g, settingsDoc);
+      SaveSettings(batchOptions, loadedOptions, overriddenOptions,
+                   settingsDoc);
       XMLToFile("settings.conf", settingsDoc);
       g->IO.WantSaveIniSettings = false;
     }
@@ -355,6 +392,8 @@ int _tmain(int argc, TCHAR *argv[]) {
     glfwPollEvents();
   }
 
+  // Stops running job before its temp storages are cleaned
+  modules.reset();
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();
@@ -362,4 +401,6 @@ int _tmain(int argc, TCHAR *argv[]) {
   glfwDestroyWindow(window);
   glfwTerminate();
   CleanCurrentTempStorage();
+  FinishTempStorageCleanup();
+  CleanRamStorage();
 }
@@ -15,8 +15,12 @@
     along with this program.If not, see <https://www.gnu.org/licenses/>.
 */
 
+#pragma once
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 using ImU32 = unsigned;
@@ -37,10 +41,96 @@ struct Queue {
 struct QueueContext {
   std::vector<Queue> queue;
   virtual void ProcessQueue() = 0;
+  // Prints files, sizes and estimated duration of ProcessQueue
+  virtual void PlanQueue() = 0;
+  // Processes files changed in queue until stop is set
+  virtual void WatchQueue(const std::atomic_bool &stop) = 0;
   virtual ~QueueContext() = default;
 };
 
-std::shared_ptr<QueueContext> MakeWorkerContext(APPContext *ctx);
+enum class ShardMode {
+  PathHash,
+  SizeBalanced,
+};
+
+enum class PrefetchMode {
+  // Data is read, works with network and FUSE storage
+  Read,
+  // Kernel is asked to read ahead, no data is copied
+  Hint,
+};
+
+enum class LinkPolicy {
+  // Always write new copy
+  Copy,
+  // Share extents where filesystem supports it, otherwise copy
+  Reflink,
+};
+
+enum class LogVerbosity {
+  // Line for every processed file
+  Files,
+  // Periodic count of processed files
+  Summary,
+};
+
+struct BatchOptions {
+  // Tells apart reruns of same queue in lease boards and shard reports,
+  // not saved
+  std::string jobName;
+  // Process only files of shard shardIndex out of shardCount
+  int shardIndex = 0;
+  int shardCount = 1;
+  ShardMode shardMode = ShardMode::PathHash;
+  // Shared folder for per shard and merged reports
+  std::string reportFolder;
+  // Shared folder for cooperative processing, enables lease mode
+  std::string leaseFolder;
+  int leaseChunkSize = 64;
+  int leaseTimeout = 120;
+  // Process files in this many worker processes instead of threads
+  int workerProcesses = 0;
+  // Worker stuck on single file longer than this is killed, 0 disables it
+  int workerTimeout = 1800;
+  // MiB of inputs read ahead of workers, 0 disables prefetching
+  int prefetchWindow = 0;
+  PrefetchMode prefetchMode = PrefetchMode::Read;
+  // MiB of temp files kept in RAM, 0 keeps them on disk, applied on start
+  int tempRamLimit = 0;
+  LogVerbosity logVerbosity = LogVerbosity::Files;
+  // Local or shared folder of outputs, keyed by input contents and settings
+  std::string cacheFolder;
+  // How cached outputs are materialized and stored
+  LinkPolicy linkPolicy = LinkPolicy::Reflink;
+  // Record processing pass into this file, for ReplayBatch, not saved
+  std::string recordFile;
+  // Replay record inside replayFolder instead of starting UI, not saved
+  std::string replayFile;
+  std::string replayFolder;
+};
+
+extern BatchOptions batchOptions;
+
+void ParseBatchArgs(const std::vector<std::string> &args,
+                    BatchOptions &options);
+void BatchOptionsUI(BatchOptions &options);
+
+// First byte of worker setup, tells how worker processes load context
+constexpr char WORKER_SETUP_MODULE = 'M';
+constexpr char WORKER_SETUP_REPLAY = 'R';
+
+// Worker processes load context from workerSetup on their own, without it
+// files are processed in threads
+std::shared_ptr<QueueContext> MakeWorkerContext(APPContext *ctx,
+                                                const BatchOptions &options,
+                                                std::string workerSetup);
+// Load worker setups made by Modules and ReplayBatch, without first byte
+APPContext LoadModuleWorker(std::string_view setup);
+APPContext LoadReplayWorker(std::string_view setup);
+// Forks zygote of worker processes, before any other thread is started
+void InitWorkerProcesses();
+// Hash of module header and every reflected setting affecting its output
+uint64_t SettingsHash(APPContext &ctx);
 
 void ExplorerWindow(MountManager &man, std::vector<Queue> &queue);
 void MountsWindow(MountManager &man);
@@ -48,6 +138,8 @@ std::unique_ptr<MountManager> CreateMountsContext();
 
 void InitLogs();
 void Logs();
+// Hand log messages over to forward instead of Logs window
+void ForwardLogs(void (*forward)(int type, std::string_view payload));
 
 struct ModulesContext {
   virtual ~ModulesContext() = default;
@@ -62,5 +154,9 @@ bool Spinner(const char *label, float radius, int thickness, const ImU32 &color,
              float rotationOffset = 0.f);
 }
 
-bool UIStack(bool isDone);
+// Shows Stop button while job runs, if stop is set
+bool UIStack(bool isDone, std::atomic_bool *stop = nullptr);
+struct LogLine;
+// DetailedProgressBar counts bytes, throughput is shown as size per second
+void ProgressInBytes(const LogLine *bar);
 void OpenInBrowser(const std::string &url);
@@ -0,0 +1,147 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "mapped_file.hpp"
+#include <algorithm>
+
+#ifdef USEWIN
+MappedFile::MappedFile(const std::string &, Access) {}
+MappedFile::~MappedFile() {}
+void MappedFile::Advise(Access) const {}
+InputFile::InputFile(const std::string &, MappedFile::Access) {}
+InputFile::~InputFile() {}
+std::string InputFile::Read(size_t, size_t) const { return {}; }
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &path, Access access) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return;
+  }
+
+  size = st.st_size;
+
+  // Empty files cannot be mapped, but empty view is valid
+  if (size) {
+    void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mem == MAP_FAILED) {
+      size = 0;
+      close(fd);
+      return;
+    }
+
+    data = static_cast<char *>(mem);
+  }
+
+  // Mapping holds its own reference to file
+  close(fd);
+  mapped = true;
+  Advise(access);
+}
+
+MappedFile::~MappedFile() {
+  if (data) {
+    munmap(data, size);
+  }
+}
+
+void MappedFile::Advise(Access access) const {
+  if (!data) {
+    return;
+  }
+
+  static constexpr int ADVICE[]{MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED};
+  madvise(data, size, ADVICE[int(access)]);
+}
+
+InputFile::InputFile(const std::string &path, MappedFile::Access access) {
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  size = st.st_size;
+  static constexpr int ADVICE[]{POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+                                POSIX_FADV_WILLNEED};
+  posix_fadvise(fd, 0, 0, ADVICE[int(access)]);
+}
+
+InputFile::~InputFile() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+std::string InputFile::Read(size_t numBytes, size_t begin) const {
+  if (begin >= size) {
+    return {};
+  }
+
+  std::string buffer(std::min<uint64_t>(numBytes, size - begin), '\0');
+  size_t numRead = 0;
+
+  while (numRead < buffer.size()) {
+    const ssize_t result = pread(fd, buffer.data() + numRead,
+                                 buffer.size() - numRead, begin + numRead);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    // Truncated meanwhile
+    if (result <= 0) {
+      break;
+    }
+
+    numRead += result;
+  }
+
+  buffer.resize(numRead);
+  return buffer;
+}
+#endif
+
+std::string_view MappedFile::View(size_t numBytes, size_t begin) const {
+  if (begin >= size) {
+    return {};
+  }
+
+  return {data + begin, std::min<uint64_t>(numBytes, size - begin)};
+}
@@ -0,0 +1,78 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Read only view of whole file. Regular files are memory mapped, so reads
+// are served from page cache without copying through stream buffers.
+// Pipes, special files and failed mappings stay unmapped, callers then fall
+// back to input context streams.
+// Mapped file must not be truncated while viewed, access past new end raises
+// SIGBUS. Only use it for files owned by ImSpike, never for inputs.
+class MappedFile {
+public:
+  enum class Access {
+    Sequential, // Aggressive read-ahead, pages are dropped behind reader
+    Random,     // No read-ahead, for headers and tables of contents
+    WillNeed,   // Start reading whole file right away
+  };
+
+  explicit MappedFile(const std::string &path,
+                      Access access = Access::Sequential);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool Mapped() const { return mapped; }
+  uint64_t Size() const { return size; }
+  // Same arguments as AppContextShare::GetBuffer, clamped to file size
+  std::string_view View(size_t numBytes = -1, size_t begin = 0) const;
+  void Advise(Access access) const;
+
+private:
+  char *data = nullptr;
+  uint64_t size = 0;
+  bool mapped = false;
+};
+
+// Positional reads of regular file, without shared stream position, so
+// threads can read chunks at once. Input truncated meanwhile only yields
+// short reads.
+// Inputs are not mapped. Precore hands input data over as std::string, so
+// mapped pages would be copied all the same, while truncated input would
+// raise SIGBUS in whole process.
+// Pipes and special files are not opened, callers then fall back to input
+// context streams.
+class InputFile {
+public:
+  explicit InputFile(const std::string &path,
+                     MappedFile::Access access = MappedFile::Access::Random);
+  ~InputFile();
+  InputFile(const InputFile &) = delete;
+  InputFile &operator=(const InputFile &) = delete;
+
+  bool Opened() const { return fd >= 0; }
+  // Same arguments as AppContextShare::GetBuffer, clamped to file size
+  std::string Read(size_t numBytes = -1, size_t begin = 0) const;
+
+private:
+  int fd = -1;
+  uint64_t size = 0;
+};
@@ -22,8 +22,10 @@
 #include "font_awesome4/definitions.h"
 #include "imgui_internal.h"
 #include "main.hpp"
+#include "shard.hpp"
 #include "spike/console.hpp"
 #include "spike/context.hpp"
+#include "worker_farm.hpp"
 #include <cinttypes>
 #include <future>
 #include <sstream>
@@ -659,6 +661,105 @@ void MakeSettingsStack(SettingsStack &stack, ReflectorFriend &reflected) {
   }
 }
 
+static uint64_t HashSettings(ReflectorFriend &reflected, uint64_t seed) {
+  auto rtInstance = RTInstance(reflected);
+  auto rtti = rtInstance.Refl();
+  auto instance = static_cast<char *>(rtInstance.Instance());
+
+  for (size_t r = 0; r < rtti->nTypes; ++r) {
+    auto &type = rtti->types[r];
+    char *addr = instance + type.offset;
+    seed = PathHash(rtti->typeNames[r], seed);
+
+    switch (type.type) {
+    case REFType::String:
+      seed = PathHash(*reinterpret_cast<std::string *>(addr), seed);
+      break;
+
+    case REFType::Class: {
+      auto refClass =
+          reflectorStatic::Registry().at(JenHash(type.asClass.typeHash));
+      ReflectedInstance inst(refClass, addr);
+      ReflectorPureWrap refWrap(inst);
+      seed = HashSettings(reinterpret_cast<ReflectorFriend &>(refWrap), seed);
+      break;
+    }
+
+    default:
+      seed = PathHash({addr, type.size}, seed);
+      break;
+    }
+  }
+
+  return seed;
+}
+
+// Same walk as HashSettings, strings are length prefixed, rest is copied
+static void WriteSettings(ReflectorFriend &reflected, std::string &out) {
+  auto rtInstance = RTInstance(reflected);
+  auto rtti = rtInstance.Refl();
+  auto instance = static_cast<char *>(rtInstance.Instance());
+
+  for (size_t r = 0; r < rtti->nTypes; ++r) {
+    auto &type = rtti->types[r];
+    char *addr = instance + type.offset;
+
+    switch (type.type) {
+    case REFType::String:
+      AppendSetupField(out, *reinterpret_cast<std::string *>(addr));
+      break;
+
+    case REFType::Class: {
+      auto refClass =
+          reflectorStatic::Registry().at(JenHash(type.asClass.typeHash));
+      ReflectedInstance inst(refClass, addr);
+      ReflectorPureWrap refWrap(inst);
+      WriteSettings(reinterpret_cast<ReflectorFriend &>(refWrap), out);
+      break;
+    }
+
+    default:
+      out.append(addr, type.size);
+      break;
+    }
+  }
+}
+
+static void ReadSettings(ReflectorFriend &reflected, std::string_view &in) {
+  auto rtInstance = RTInstance(reflected);
+  auto rtti = rtInstance.Refl();
+  auto instance = static_cast<char *>(rtInstance.Instance());
+
+  for (size_t r = 0; r < rtti->nTypes; ++r) {
+    auto &type = rtti->types[r];
+    char *addr = instance + type.offset;
+
+    switch (type.type) {
+    case REFType::String:
+      *reinterpret_cast<std::string *>(addr) = TakeSetupField(in);
+      break;
+
+    case REFType::Class: {
+      auto refClass =
+          reflectorStatic::Registry().at(JenHash(type.asClass.typeHash));
+      ReflectedInstance inst(refClass, addr);
+      ReflectorPureWrap refWrap(inst);
+      ReadSettings(reinterpret_cast<ReflectorFriend &>(refWrap), in);
+      break;
+    }
+
+    default:
+      if (in.size() < type.size) {
+        throw std::runtime_error("Malformed worker setup");
+      }
+
+      memcpy(addr, in.data(), type.size);
+      in.remove_prefix(type.size);
+      break;
+    }
+  }
+}
+
 void Draw(SettingsStack &stack) {
   for (auto &f : stack) {
     f();
@@ -677,6 +778,16 @@ struct ModulesContextImpl : ModulesContext {
   SettingsStack moduleSettingsStack;
   std::string helpText;
   std::optional<std::future<void>> processingJob;
+  // Set by Stop button of endless jobs or on exit
+  std::atomic_bool stopJob{false};
+  // Running job only ends by stopJob
+  bool endlessJob = false;
+
+  ~ModulesContextImpl() {
+    // Future would wait for endless job forever
+    stopJob = true;
+    processingJob.reset();
+  }
 
   void Refresh() {
     es::Dispose(moduleCtx);
@@ -687,6 +798,53 @@ struct ModulesContextImpl : ModulesContext {
 };
 } // namespace
 
+// Worker processes are forked before any module is loaded, they load
+// selected module again and apply current settings
+static std::string WorkerSetup(ModulesContextImpl &ctx) {
+  if (ctx.modules.empty()) {
+    return {};
+  }
+
+  auto &modInfo = ctx.modules.at(ctx.selectedModule);
+  std::string setup(1, WORKER_SETUP_MODULE);
+  AppendSetupField(setup, modInfo.module);
+  AppendSetupField(setup, modInfo.folder);
+  WriteSettings(MainSettings(), setup);
+  WriteSettings(CliSettings(), setup);
+
+  if (ctx.moduleCtx.info && ctx.moduleCtx.info->settings) {
+    WriteSettings(*ctx.moduleCtx.info->settings, setup);
+  }
+
+  return setup;
+}
+
+APPContext LoadModuleWorker(std::string_view setup) {
+  const std::string module(TakeSetupField(setup));
+  const std::string folder(TakeSetupField(setup));
+  APPContext ctx(module.data(), folder, {});
+  ReadSettings(MainSettings(), setup);
+  ReadSettings(CliSettings(), setup);
+
+  if (ctx.info && ctx.info->settings) {
+    ReadSettings(*ctx.info->settings, setup);
+  }
+
+  return ctx;
+}
+
+uint64_t SettingsHash(APPContext &ctx) {
+  uint64_t seed = PathHash(ctx.info->header);
+  seed = HashSettings(MainSettings(), seed);
+  seed = HashSettings(CliSettings(), seed);
+
+  if (ctx.info->settings) {
+    seed = HashSettings(*ctx.info->settings, seed);
+  }
+
+  return seed;
+}
+
 namespace ImGui {
 // https://github.com/ocornut/imgui/issues/1901
 bool Spinner(const char *label, float radius, int thickness, const ImU32 &color,
@@ -767,9 +925,12 @@ void Modules(ModulesContext &ctx_, std::vector<Queue> &queue) {
 
   if (ctx.processingJob) {
     if (UIStack(ctx.processingJob->wait_for(std::chrono::seconds(0)) ==
-                std::future_status::ready)) {
+                    std::future_status::ready,
+                ctx.endlessJob ? &ctx.stopJob : nullptr)) {
       ctx.processingJob->get();
       ctx.processingJob.reset();
+      ctx.endlessJob = false;
+      ctx.stopJob = false;
       ModifyElements([&](ElementAPI &api) { api.Clean(); });
     }
   }
@@ -780,6 +941,7 @@ void Modules(ModulesContext &ctx_, std::vector<Queue> &queue) {
   if (ImGui::BeginChild("ModulesTblCommon", {0, -24})) {
     ImGui::TextUnformatted("Common settings");
     Draw(ctx.mainSettingsStack);
+    BatchOptionsUI(batchOptions);
     ImGui::Separator();
 
     if (ImGui::Combo(
@@ -828,7 +990,9 @@ void Modules(ModulesContext &ctx_, std::vector<Queue> &queue) {
     ImGui::BeginDisabled(queueMode);
     if (ImGui::Button("Process current queue")) {
       ctx.processingJob = std::async(
-          [payload = MakeWorkerContext(&ctx.moduleCtx), queue = queue] {
+          [payload = MakeWorkerContext(&ctx.moduleCtx, batchOptions,
+                                       WorkerSetup(ctx)),
+           queue = queue] {
             payload->queue = std::move(queue);
             try {
               payload->ProcessQueue();
@@ -839,6 +1003,40 @@ void Modules(ModulesContext &ctx_, std::vector<Queue> &queue) {
             }
           });
     }
+    ImGui::SameLine();
+    if (ImGui::Button("Plan current queue")) {
+      ctx.processingJob = std::async(
+          [payload = MakeWorkerContext(&ctx.moduleCtx, batchOptions,
+                                       WorkerSetup(ctx)),
+           queue = queue] {
+            payload->queue = std::move(queue);
+            try {
+              payload->PlanQueue();
+            } catch (const std::exception &e) {
+              printerror(e.what());
+            } catch (...) {
+              printerror("Uncaught exception");
+            }
+          });
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Watch current queue")) {
+      ctx.stopJob = false;
+      ctx.endlessJob = true;
+      ctx.processingJob = std::async(
+          [payload = MakeWorkerContext(&ctx.moduleCtx, batchOptions,
+                                       WorkerSetup(ctx)),
+           queue = queue, &stop = ctx.stopJob] {
+            payload->queue = std::move(queue);
+            try {
+              payload->WatchQueue(stop);
+            } catch (const std::exception &e) {
+              printerror(e.what());
+            } catch (...) {
+              printerror("Uncaught exception");
+            }
+          });
+    }
     ImGui::EndDisabled();
     ImGui::BeginDisabled(!queueMode);
     ImGui::SameLine();
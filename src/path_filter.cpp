@@ -0,0 +1,189 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "path_filter.hpp"
+#include <bit>
+
+void PathFilter::AddFilter(std::string_view filter) {
+  const bool clampBegin = !filter.empty() && filter.front() == '^';
+  if (clampBegin) {
+    filter.remove_prefix(1);
+  }
+
+  const bool clampEnd = !filter.empty() && filter.back() == '$';
+  if (clampEnd) {
+    filter.remove_suffix(1);
+  }
+
+  const size_t patternStart = nodes.size();
+  patternStarts.push_back(patternStart);
+
+  auto PushStar = [&] {
+    if (nodes.size() == patternStart || nodes.back().type != NodeType::Star) {
+      nodes.push_back({NodeType::Star, 0});
+    }
+  };
+
+  if (!clampBegin) {
+    PushStar();
+  }
+
+  for (auto c : filter) {
+    if (c == '*') {
+      PushStar();
+    } else {
+      nodes.push_back({NodeType::Literal, c});
+    }
+  }
+
+  if (!clampEnd) {
+    PushStar();
+  }
+
+  nodes.push_back({NodeType::Accept, 0});
+  numFilters++;
+  Reset();
+}
+
+void PathFilter::Clear() {
+  nodes.clear();
+  patternStarts.clear();
+  numFilters = 0;
+  Reset();
+}
+
+void PathFilter::Reset() {
+  states.clear();
+  stateSets.clear();
+  stateLookup.clear();
+
+  if (!numFilters) {
+    return;
+  }
+
+  StateSet start((nodes.size() + 63) / 64);
+
+  for (auto s : patternStarts) {
+    AddClosure(start, s);
+  }
+
+  Intern(std::move(start));
+}
+
+void PathFilter::AddClosure(StateSet &set, size_t node) const {
+  for (; node < nodes.size(); node++) {
+    set[node / 64] |= uint64_t(1) << (node % 64);
+
+    if (nodes[node].type != NodeType::Star) {
+      break;
+    }
+  }
+}
+
+int32_t PathFilter::Intern(StateSet &&set) {
+  if (auto found = stateLookup.find(set); found != stateLookup.end()) {
+    return found->second;
+  }
+
+  DState state;
+  state.next.fill(-1);
+  state.dead = true;
+
+  for (size_t w = 0; w < set.size(); w++) {
+    for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+      const size_t node = w * 64 + std::countr_zero(bits);
+      state.dead = false;
+
+      if (nodes[node].type == NodeType::Accept) {
+        state.accept = true;
+      } else if (nodes[node].type == NodeType::Star &&
+                 nodes[node + 1].type == NodeType::Accept) {
+        state.sticky = true;
+      }
+    }
+  }
+
+  const int32_t index = states.size();
+  states.push_back(state);
+  stateSets.push_back(set);
+  stateLookup.emplace(std::move(set), index);
+
+  return index;
+}
+
+int32_t PathFilter::Transition(int32_t state, uint8_t c) {
+  StateSet current = stateSets[state];
+
+  if (states.size() >= MAX_STATES) {
+    Reset();
+    state = Intern(StateSet(current));
+  }
+
+  StateSet next(current.size());
+
+  for (size_t w = 0; w < current.size(); w++) {
+    for (uint64_t bits = current[w]; bits; bits &= bits - 1) {
+      const size_t node = w * 64 + std::countr_zero(bits);
+
+      switch (nodes[node].type) {
+      case NodeType::Literal:
+        if (uint8_t(nodes[node].chr) == c) {
+          AddClosure(next, node + 1);
+        }
+        break;
+      case NodeType::Star:
+        AddClosure(next, node);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  const int32_t retVal = Intern(std::move(next));
+  states[state].next[c] = retVal;
+
+  return retVal;
+}
+
+bool PathFilter::IsFiltered(std::string_view fileName) {
+  if (!numFilters) {
+    return true;
+  }
+
+  int32_t state = 0;
+
+  for (uint8_t c : fileName) {
+    if (states[state].sticky) {
+      return true;
+    }
+
+    if (states[state].dead) {
+      return false;
+    }
+
+    int32_t next = states[state].next[c];
+
+    if (next < 0) {
+      next = Transition(state, c);
+    }
+
+    state = next;
+  }
+
+  return states[state].accept;
+}
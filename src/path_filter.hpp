@@ -0,0 +1,71 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string_view>
+#include <vector>
+
+// Matches file names against all module filters in a single pass.
+// Filters use DirectoryScanner syntax: '^' anchors begin, '$' anchors end and
+// '*' matches any sequence. All filters are compiled into one NFA, which is
+// turned into a DFA lazily, state by state, as paths are matched.
+// Not thread safe, meant to be used by the scanning thread.
+class PathFilter {
+public:
+  void AddFilter(std::string_view filter);
+  void Clear();
+  bool Empty() const { return numFilters == 0; }
+
+  // Returns true for accepted file name, or when there are no filters.
+  bool IsFiltered(std::string_view fileName);
+
+private:
+  enum class NodeType : uint8_t { Literal, Star, Accept };
+
+  struct Node {
+    NodeType type;
+    char chr;
+  };
+
+  using StateSet = std::vector<uint64_t>;
+
+  struct DState {
+    std::array<int32_t, 256> next;
+    bool accept = false;
+    // Accepting no matter what follows
+    bool sticky = false;
+    bool dead = false;
+  };
+
+  static constexpr size_t MAX_STATES = 4096;
+
+  std::vector<Node> nodes;
+  std::vector<uint32_t> patternStarts;
+  size_t numFilters = 0;
+
+  std::vector<DState> states;
+  std::vector<StateSet> stateSets;
+  std::map<StateSet, int32_t> stateLookup;
+
+  void AddClosure(StateSet &set, size_t node) const;
+  int32_t Intern(StateSet &&set);
+  int32_t Transition(int32_t state, uint8_t c);
+  void Reset();
+};
@@ -0,0 +1,353 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "planner.hpp"
+#include "datas/master_printer.hpp"
+#include "datas/pugiex.hpp"
+#include "shard.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#include <filesystem>
+
+static constexpr const char HISTORY_FILE[] = "throughput.conf";
+// Key of module wide sample, used for extensions without history
+static constexpr const char ANY_EXTENSION[] = "*";
+// Older samples are scaled down past this, so history follows changes
+// in modules and machines
+static constexpr size_t HISTORY_FILES = 10000;
+// Files of every extension with measured outputs, per run
+static constexpr size_t OUTPUT_SAMPLES = 32;
+
+std::string FileExtension(std::string_view path) {
+  const size_t lastSlash = path.find_last_of("/\\");
+
+  if (lastSlash != path.npos) {
+    path.remove_prefix(lastSlash + 1);
+  }
+
+  const size_t lastDot = path.find_last_of('.');
+
+  if (lastDot == path.npos || lastDot == 0) {
+    return {};
+  }
+
+  std::string retVal(path.substr(lastDot));
+  std::transform(retVal.begin(), retVal.end(), retVal.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+
+  return retVal;
+}
+
+static pugi::xml_document LoadHistory() {
+  std::error_code ec;
+
+  if (std::filesystem::exists(HISTORY_FILE, ec)) {
+    try {
+      return XMLFromFile(HISTORY_FILE);
+    } catch (const std::exception &e) {
+      printwarning("Cannot load " << HISTORY_FILE << ": " << e.what());
+    }
+  }
+
+  return {};
+}
+
+static pugi::xml_node ModuleNode(pugi::xml_document &doc,
+                                 const std::string &module, bool create) {
+  auto root = doc.child("throughput");
+
+  if (!root && create) {
+    root = doc.append_child("throughput");
+  }
+
+  auto node = root.find_child_by_attribute("module", "name", module.c_str());
+
+  if (!node && create) {
+    node = root.append_child("module");
+    node.append_attribute("name").set_value(module.c_str());
+  }
+
+  return node;
+}
+
+void ThroughputHistory::Load(pugi::xml_document &doc) {
+  history.clear();
+
+  for (auto ext : ModuleNode(doc, module, false).children("extension")) {
+    ThroughputSample sample;
+    sample.numFiles = ext.attribute("files").as_ullong();
+    sample.numBytes = ext.attribute("bytes").as_ullong();
+    sample.seconds = ext.attribute("seconds").as_double();
+    sample.sampledBytes = ext.attribute("sampled_bytes").as_ullong();
+    sample.outputBytes = ext.attribute("output_bytes").as_ullong();
+    history.emplace(ext.attribute("name").as_string(), sample);
+  }
+}
+
+ThroughputHistory::ThroughputHistory(std::string_view module_)
+    : module(module_) {
+  auto doc = LoadHistory();
+  Load(doc);
+}
+
+void ThroughputHistory::Record(std::string_view path, uint64_t fileSize,
+                               double seconds) {
+  std::lock_guard<std::mutex> lg(recordMutex);
+
+  for (auto key : {FileExtension(path), std::string(ANY_EXTENSION)}) {
+    auto &sample = recorded[key];
+    sample.numFiles++;
+    sample.numBytes += fileSize;
+    sample.seconds += seconds;
+  }
+}
+
+bool ThroughputHistory::SampleOutputs(std::string_view path) {
+  std::lock_guard<std::mutex> lg(recordMutex);
+  return numSampled[FileExtension(path)]++ < OUTPUT_SAMPLES;
+}
+
+void ThroughputHistory::RecordOutputs(std::string_view path,
+                                      uint64_t fileSize,
+                                      uint64_t outputBytes) {
+  std::lock_guard<std::mutex> lg(recordMutex);
+
+  for (auto key : {FileExtension(path), std::string(ANY_EXTENSION)}) {
+    auto &sample = recorded[key];
+    sample.sampledBytes += fileSize;
+    sample.outputBytes += outputBytes;
+  }
+}
+
+void ThroughputHistory::Save() {
+  std::lock_guard<std::mutex> lg(recordMutex);
+
+  if (recorded.empty()) {
+    return;
+  }
+
+  // Other instances might have saved since, their samples are kept
+  auto doc = LoadHistory();
+  Load(doc);
+
+  for (auto &[key, newSample] : recorded) {
+    auto &sample = history[key];
+
+    if (sample.numFiles + newSample.numFiles > HISTORY_FILES &&
+        sample.numFiles > 0) {
+      const size_t keepFiles =
+          HISTORY_FILES - std::min(newSample.numFiles, HISTORY_FILES / 2);
+      const double scale =
+          std::min(double(keepFiles) / double(sample.numFiles), 1.0);
+      sample.numFiles = size_t(sample.numFiles * scale);
+      sample.numBytes = uint64_t(sample.numBytes * scale);
+      sample.seconds *= scale;
+      sample.sampledBytes = uint64_t(sample.sampledBytes * scale);
+      sample.outputBytes = uint64_t(sample.outputBytes * scale);
+    }
+
+    sample.numFiles += newSample.numFiles;
+    sample.numBytes += newSample.numBytes;
+    sample.seconds += newSample.seconds;
+    sample.sampledBytes += newSample.sampledBytes;
+    sample.outputBytes += newSample.outputBytes;
+  }
+
+  recorded.clear();
+
+  try {
+    auto node = ModuleNode(doc, module, true);
+
+    while (auto child = node.child("extension")) {
+      node.remove_child(child);
+    }
+
+    for (auto &[key, sample] : history) {
+      auto ext = node.append_child("extension");
+      ext.append_attribute("name").set_value(key.c_str());
+      ext.append_attribute("files").set_value(sample.numFiles);
+      ext.append_attribute("bytes").set_value(sample.numBytes);
+      ext.append_attribute("seconds").set_value(sample.seconds);
+      ext.append_attribute("sampled_bytes").set_value(sample.sampledBytes);
+      ext.append_attribute("output_bytes").set_value(sample.outputBytes);
+    }
+
+    // Renamed over, other instances never load half written history
+    const std::string tmpPath =
+        std::string(HISTORY_FILE) + ".tmp-" + NodeName();
+    XMLToFile(tmpPath, doc);
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, HISTORY_FILE, ec);
+
+    if (ec) {
+      printwarning("Cannot save " << HISTORY_FILE << ": " << ec.message());
+      std::filesystem::remove(tmpPath, ec);
+    }
+  } catch (const std::exception &e) {
+    printwarning("Cannot save " << HISTORY_FILE << ": " << e.what());
+  }
+}
+
+double ThroughputHistory::Estimate(std::string_view extension, size_t numFiles,
+                                   uint64_t numBytes) const {
+  auto found = history.find(extension);
+
+  if (found == history.end() || !found->second.numFiles) {
+    found = history.find(ANY_EXTENSION);
+  }
+
+  if (found == history.end() || !found->second.numFiles) {
+    return -1;
+  }
+
+  auto &sample = found->second;
+
+  // Processing time mostly follows input size, unless history only has
+  // empty files
+  if (sample.numBytes && numBytes) {
+    return sample.seconds * (double(numBytes) / double(sample.numBytes));
+  }
+
+  return sample.seconds * (double(numFiles) / double(sample.numFiles));
+}
+
+double ThroughputHistory::EstimateOutputs(std::string_view extension,
+                                          uint64_t numBytes) const {
+  auto found = history.find(extension);
+
+  if (found == history.end() || !found->second.sampledBytes) {
+    found = history.find(ANY_EXTENSION);
+  }
+
+  if (found == history.end() || !found->second.sampledBytes) {
+    return -1;
+  }
+
+  auto &sample = found->second;
+  return double(sample.outputBytes) *
+         (double(numBytes) / double(sample.sampledBytes));
+}
+
+std::string FormatBytes(uint64_t numBytes) {
+  static const char *units[]{"B", "KiB", "MiB", "GiB", "TiB"};
+  double value = double(numBytes);
+  size_t unit = 0;
+
+  while (value >= 1024 && unit + 1 < std::size(units)) {
+    value /= 1024;
+    unit++;
+  }
+
+  char buffer[32]{};
+  snprintf(buffer, sizeof(buffer), unit ? "%.2f %s" : "%.0f %s", value,
+           units[unit]);
+  return buffer;
+}
+
+std::string FormatDuration(double seconds) {
+  const uint64_t total = uint64_t(seconds + 0.5);
+  char buffer[64]{};
+
+  if (total >= 3600) {
+    snprintf(buffer, sizeof(buffer), "%" PRIu64 "h %02" PRIu64 "m",
+             total / 3600, (total / 60) % 60);
+  } else if (total >= 60) {
+    snprintf(buffer, sizeof(buffer), "%" PRIu64 "m %02" PRIu64 "s",
+             total / 60, total % 60);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%" PRIu64 "s", total);
+  }
+
+  return buffer;
+}
+
+void PrintQueuePlan(const QueuePlan &plan, const ThroughputHistory &history,
+                    size_t numWorkers) {
+  numWorkers = std::max(numWorkers, size_t(1));
+  size_t numFiles = 0;
+  uint64_t numBytes = 0;
+  double seconds = 0;
+  size_t numUnknownFiles = 0;
+  double outputBytes = 0;
+  size_t numUnknownOutputs = 0;
+
+  for (auto &[ext, group] : plan.groups) {
+    numFiles += group.numFiles;
+    numBytes += group.numBytes;
+    const double groupSeconds =
+        history.Estimate(ext, group.numFiles, group.numBytes);
+    const double groupOutputs = history.EstimateOutputs(ext, group.numBytes);
+    std::string outputs;
+
+    if (groupOutputs < 0) {
+      numUnknownOutputs += group.numFiles;
+    } else {
+      outputBytes += groupOutputs;
+      outputs = ", ~" + FormatBytes(uint64_t(groupOutputs)) + " of output";
+    }
+
+    if (groupSeconds < 0) {
+      numUnknownFiles += group.numFiles;
+      printline((ext.empty() ? "<none>" : ext)
+                << ": " << group.numFiles << " files, "
+                << FormatBytes(group.numBytes) << ", no history" << outputs);
+    } else {
+      seconds += groupSeconds;
+      printline((ext.empty() ? "<none>" : ext)
+                << ": " << group.numFiles << " files, "
+                << FormatBytes(group.numBytes) << ", ~"
+                << FormatDuration(groupSeconds / numWorkers) << outputs);
+    }
+  }
+
+  printinfo("Plan: " << numFiles << " files, " << FormatBytes(numBytes)
+                     << " of input.");
+
+  if (numUnknownOutputs < numFiles) {
+    printinfo("Estimated output: ~" << FormatBytes(uint64_t(outputBytes))
+                                    << ".");
+
+    if (numUnknownOutputs) {
+      printwarning("Output estimate excludes "
+                   << numUnknownOutputs << " files without history.");
+    }
+  }
+
+  if (plan.hasOutputFiles) {
+    printinfo("Module reports " << plan.numOutputFiles
+                                 << " files to be extracted.");
+  }
+
+  if (plan.numFailed) {
+    printwarning(plan.numFailed << " files could not be inspected.");
+  }
+
+  if (numUnknownFiles == numFiles) {
+    printinfo("No throughput history for this module yet, duration will be "
+              "estimated after first run.");
+  } else {
+    printinfo("Estimated duration: ~" << FormatDuration(seconds / numWorkers)
+                                      << " with " << numWorkers
+                                      << " workers.");
+
+    if (numUnknownFiles) {
+      printwarning("Estimate excludes " << numUnknownFiles
+                                        << " files without history.");
+    }
+  }
+}
@@ -0,0 +1,92 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "datas/pugi_fwd.hpp"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Lower case extension including dot, empty if there is none
+std::string FileExtension(std::string_view path);
+std::string FormatBytes(uint64_t numBytes);
+std::string FormatDuration(double seconds);
+
+struct ThroughputSample {
+  size_t numFiles = 0;
+  uint64_t numBytes = 0;
+  // Sum of per file processing times, not wall time
+  double seconds = 0;
+  // Input bytes of files with measured outputs and size of those outputs
+  uint64_t sampledBytes = 0;
+  uint64_t outputBytes = 0;
+};
+
+// Per module and per extension processing times of previous runs,
+// stored in throughput.conf next to settings.conf.
+class ThroughputHistory {
+public:
+  explicit ThroughputHistory(std::string_view module);
+
+  // Thread safe
+  void Record(std::string_view path, uint64_t fileSize, double seconds);
+  // Thread safe, tells if outputs of file should be measured for
+  // RecordOutputs. Only first few files of every extension are, measuring
+  // lists whole output folder.
+  bool SampleOutputs(std::string_view path);
+  // Thread safe
+  void RecordOutputs(std::string_view path, uint64_t fileSize,
+                     uint64_t outputBytes);
+  // Merges recorded samples into history stored meanwhile
+  void Save();
+
+  // Summed processing time in seconds, negative when there is no history
+  double Estimate(std::string_view extension, size_t numFiles,
+                  uint64_t numBytes) const;
+  // Bytes of outputs made from input bytes, negative when there is no
+  // history
+  double EstimateOutputs(std::string_view extension, uint64_t numBytes) const;
+
+private:
+  std::string module;
+  std::map<std::string, ThroughputSample, std::less<>> history;
+  std::map<std::string, ThroughputSample, std::less<>> recorded;
+  std::map<std::string, size_t, std::less<>> numSampled;
+  std::mutex recordMutex;
+
+  void Load(pugi::xml_document &doc);
+};
+
+struct QueuePlan {
+  struct Group {
+    size_t numFiles = 0;
+    uint64_t numBytes = 0;
+  };
+
+  // Grouped by extension
+  std::map<std::string, Group> groups;
+  // Sum of ExtractStat results, if module supports it
+  size_t numOutputFiles = 0;
+  bool hasOutputFiles = false;
+  size_t numFailed = 0;
+};
+
+void PrintQueuePlan(const QueuePlan &plan, const ThroughputHistory &history,
+                    size_t numWorkers);
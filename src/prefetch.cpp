@@ -0,0 +1,473 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "prefetch.hpp"
+#include <algorithm>
+#include <cstdio>
+
+static constexpr size_t CHUNK_SIZE = 256 << 10;
+// Reads in flight through io_uring
+static constexpr unsigned QUEUE_DEPTH = 32;
+// Fallback readers, each of them keeps one read in flight
+static constexpr size_t NUM_READER_THREADS = 4;
+// Enough to cover stalls of seeking disk
+static constexpr double LOOKAHEAD_SECONDS = 4;
+static constexpr uint64_t MIN_LIMIT_BYTES = 8 << 20;
+static constexpr size_t MIN_LIMIT_FILES = 8;
+static constexpr size_t MAX_LIMIT_FILES = 1024;
+
+#ifdef USEWIN
+struct Prefetcher::Ring {
+  bool Init(unsigned) { return false; }
+};
+
+void Prefetcher::RingReader() {}
+#else
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <list>
+#include <numeric>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Bare io_uring, only used by single reader thread
+struct Prefetcher::Ring {
+  int fd = -1;
+  void *sqPtr = MAP_FAILED;
+  void *cqPtr = MAP_FAILED;
+  size_t sqSize = 0;
+  size_t cqSize = 0;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  size_t sqesSize = 0;
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  io_uring_cqe *cqes;
+  unsigned numQueued = 0;
+
+  bool Init(unsigned entries) {
+    io_uring_params params{};
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (fd < 0) {
+      return false;
+    }
+
+    sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+    if (singleMap) {
+      sqSize = cqSize = std::max(sqSize, cqSize);
+    }
+
+    sqPtr = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+    if (sqPtr == MAP_FAILED) {
+      return false;
+    }
+
+    if (!singleMap) {
+      cqPtr = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+      if (cqPtr == MAP_FAILED) {
+        return false;
+      }
+    }
+
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(
+        mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+
+    char *sq = static_cast<char *>(sqPtr);
+    char *cq = static_cast<char *>(singleMap ? sqPtr : cqPtr);
+    sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    return true;
+  }
+
+  ~Ring() {
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, sqesSize);
+    }
+
+    if (cqPtr != MAP_FAILED) {
+      munmap(cqPtr, cqSize);
+    }
+
+    if (sqPtr != MAP_FAILED) {
+      munmap(sqPtr, sqSize);
+    }
+
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  // Readv is used over read, it's supported by every io_uring kernel
+  void Read(int file, const iovec *buffer, uint64_t offset, uint64_t id) {
+    const unsigned tail = *sqTail;
+    const unsigned index = tail & *sqMask;
+    io_uring_sqe &sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = file;
+    sqe.addr = reinterpret_cast<uint64_t>(buffer);
+    sqe.len = 1;
+    sqe.off = offset;
+    sqe.user_data = id;
+    sqArray[index] = index;
+    std::atomic_ref<unsigned>(*sqTail).store(tail + 1,
+                                             std::memory_order_release);
+    numQueued++;
+  }
+
+  // Submits queued reads and waits for at least one of them
+  void SubmitAndWait() {
+    while (syscall(__NR_io_uring_enter, fd, numQueued, 1,
+                   IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+           errno == EINTR) {
+    }
+
+    numQueued = 0;
+  }
+
+  template <class F> void Reap(F &&completed) {
+    unsigned head = *cqHead;
+    const unsigned tail =
+        std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire);
+
+    for (; head != tail; head++) {
+      const io_uring_cqe &cqe = cqes[head & *cqMask];
+      completed(cqe.user_data, cqe.res);
+    }
+
+    std::atomic_ref<unsigned>(*cqHead).store(head, std::memory_order_release);
+  }
+};
+
+void Prefetcher::RingReader() {
+  struct File {
+    int fd;
+    uint64_t offset;
+    uint64_t end;
+    unsigned numReading = 0;
+    bool failed = false;
+
+    bool Queued() const { return failed || offset >= end; }
+  };
+
+  std::vector<char> buffers(QUEUE_DEPTH * CHUNK_SIZE);
+  std::vector<iovec> vectors(QUEUE_DEPTH);
+  std::vector<File *> bufferFiles(QUEUE_DEPTH);
+  std::vector<unsigned> freeBuffers(QUEUE_DEPTH);
+  std::iota(freeBuffers.begin(), freeBuffers.end(), 0);
+  // Back is file being queued, others wait for their reads
+  std::list<File> files;
+  unsigned numReading = 0;
+
+  auto Completed = [&](uint64_t id, int result) {
+    File *file = bufferFiles[id];
+    file->numReading--;
+    numReading--;
+    freeBuffers.push_back(id);
+
+    if (result <= 0) {
+      file->failed = true;
+    }
+  };
+
+  while (!Stopped()) {
+    while (!freeBuffers.empty()) {
+      if (files.empty() || files.back().Queued()) {
+        std::string path;
+        uint64_t size;
+        {
+          std::lock_guard<std::mutex> lg(mutex);
+
+          if (!TryTake(path, size)) {
+            break;
+          }
+        }
+
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd >= 0) {
+          files.push_back({fd, 0, size});
+        }
+
+        continue;
+      }
+
+      File &file = files.back();
+      const unsigned id = freeBuffers.back();
+      freeBuffers.pop_back();
+      vectors[id].iov_base = buffers.data() + id * CHUNK_SIZE;
+      vectors[id].iov_len = std::min<uint64_t>(CHUNK_SIZE, file.end - file.offset);
+      bufferFiles[id] = &file;
+      ring->Read(file.fd, &vectors[id], file.offset, id);
+      file.offset += vectors[id].iov_len;
+      file.numReading++;
+      numReading++;
+    }
+
+    std::erase_if(files, [](File &f) {
+      if (f.numReading || !f.Queued()) {
+        return false;
+      }
+
+      close(f.fd);
+      return true;
+    });
+
+    if (!numReading) {
+      std::string path;
+      uint64_t size;
+      {
+        std::unique_lock<std::mutex> lg(mutex);
+        cv.wait(lg, [&] { return stop || TryTake(path, size); });
+
+        if (stop) {
+          break;
+        }
+      }
+
+      if (const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+        files.push_back({fd, 0, size});
+      }
+
+      continue;
+    }
+
+    ring->SubmitAndWait();
+    ring->Reap(Completed);
+  }
+
+  while (numReading) {
+    ring->SubmitAndWait();
+    ring->Reap(Completed);
+  }
+
+  for (auto &f : files) {
+    close(f.fd);
+  }
+}
+
+void Prefetcher::HintReader() {
+  std::string path;
+  uint64_t size;
+
+  while (Take(path, size)) {
+    if (const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+      posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+  }
+}
+#endif
+
+Prefetcher::Prefetcher(uint64_t window_, PrefetchMode mode)
+    : window(window_), limitBytes(window_), limitFiles(MAX_LIMIT_FILES) {
+#ifndef USEWIN
+  if (mode == PrefetchMode::Hint) {
+    threads.emplace_back(&Prefetcher::HintReader, this);
+    return;
+  }
+#endif
+
+  if (auto newRing = std::make_unique<Ring>(); newRing->Init(QUEUE_DEPTH)) {
+    ring = std::move(newRing);
+    threads.emplace_back(&Prefetcher::RingReader, this);
+    return;
+  }
+
+  for (size_t t = 0; t < NUM_READER_THREADS; t++) {
+    threads.emplace_back(&Prefetcher::ThreadReader, this);
+  }
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lg(mutex);
+    stop = true;
+  }
+
+  cv.notify_all();
+
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+uint64_t Prefetcher::Push(const std::string &path, uint64_t size) {
+  std::lock_guard<std::mutex> lg(mutex);
+  // Only beginning of large files can be held in cache for worker
+  entries.push_back({path, std::min(size, window)});
+  cv.notify_one();
+  return firstTicket + entries.size() - 1;
+}
+
+void Prefetcher::Started(uint64_t ticket) { Remove(ticket, true); }
+
+void Prefetcher::Cancel(uint64_t ticket) { Remove(ticket, false); }
+
+void Prefetcher::Remove(uint64_t ticket, bool started) {
+  std::lock_guard<std::mutex> lg(mutex);
+
+  if (ticket < firstTicket) {
+    return;
+  }
+
+  Entry &entry = entries[ticket - firstTicket];
+  entry.started = true;
+
+  // Cancelled files say nothing about pick up rate
+  if (started) {
+    UpdateLimits(entry.size);
+  }
+
+  if (entry.taken) {
+    ahead -= entry.size;
+    aheadFiles--;
+  }
+
+  while (!entries.empty() && entries.front().started) {
+    entries.pop_front();
+    firstTicket++;
+  }
+
+  nextTake = std::max(nextTake, firstTicket);
+  cv.notify_all();
+}
+
+bool Prefetcher::TryTake(std::string &path, uint64_t &size) {
+  for (; nextTake < firstTicket + entries.size(); nextTake++) {
+    Entry &entry = entries[nextTake - firstTicket];
+
+    // Nothing to read, or worker was faster
+    if (entry.started || !entry.size) {
+      continue;
+    }
+
+    // Large file is still taken when nothing else is ahead
+    if (aheadFiles &&
+        (ahead + entry.size > limitBytes || aheadFiles >= limitFiles)) {
+      return false;
+    }
+
+    entry.taken = true;
+    ahead += entry.size;
+    aheadFiles++;
+    path = entry.path;
+    size = entry.size;
+    nextTake++;
+    return true;
+  }
+
+  return false;
+}
+
+void Prefetcher::UpdateLimits(uint64_t startedSize) {
+  sampleBytes += startedSize;
+  sampleFiles++;
+  const auto now = clock::now();
+  const double seconds = std::chrono::duration<double>(now - lastSample).count();
+
+  if (seconds < 0.5) {
+    return;
+  }
+
+  const bool firstSample = fileRate == 0;
+  const double newByteRate = sampleBytes / seconds;
+  const double newFileRate = sampleFiles / seconds;
+  byteRate = firstSample ? newByteRate : byteRate * 0.7 + newByteRate * 0.3;
+  fileRate = firstSample ? newFileRate : fileRate * 0.7 + newFileRate * 0.3;
+  lastSample = now;
+  sampleBytes = 0;
+  sampleFiles = 0;
+
+  limitBytes = std::clamp(uint64_t(byteRate * LOOKAHEAD_SECONDS),
+                          std::min(MIN_LIMIT_BYTES, window), window);
+  limitFiles = std::clamp(size_t(fileRate * LOOKAHEAD_SECONDS),
+                          MIN_LIMIT_FILES, MAX_LIMIT_FILES);
+}
+
+bool Prefetcher::Take(std::string &path, uint64_t &size) {
+  std::unique_lock<std::mutex> lg(mutex);
+
+  while (!stop) {
+    if (TryTake(path, size)) {
+      return true;
+    }
+
+    cv.wait(lg);
+  }
+
+  return false;
+}
+
+bool Prefetcher::Stopped() {
+  std::lock_guard<std::mutex> lg(mutex);
+  return stop;
+}
+
+void Prefetcher::ThreadReader() {
+  std::vector<char> buffer(CHUNK_SIZE);
+  std::string path;
+  uint64_t size;
+
+  while (Take(path, size)) {
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file) {
+      continue;
+    }
+
+    for (uint64_t numRead = 0; numRead < size && !Stopped();) {
+      const size_t chunk = std::min<uint64_t>(CHUNK_SIZE, size - numRead);
+      const size_t result = fread(buffer.data(), 1, chunk, file);
+
+      if (!result) {
+        break;
+      }
+
+      numRead += result;
+    }
+
+    fclose(file);
+  }
+}
@@ -0,0 +1,96 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "main.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Warms page cache with files in the order they were pushed, so workers
+// find their inputs in cache instead of blocking on storage.
+// Reads are queued through io_uring, where it isn't available, a few
+// reader threads are used instead.
+// Files ahead of workers are limited by rate at which workers pick them up,
+// at most window bytes are ahead.
+class Prefetcher {
+public:
+  Prefetcher(uint64_t window, PrefetchMode mode);
+  ~Prefetcher();
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+
+  // Returns ticket for Started
+  uint64_t Push(const std::string &path, uint64_t size);
+  // File was picked up by worker, its data is no longer read ahead
+  void Started(uint64_t ticket);
+  // File won't be processed, its data is no longer read ahead
+  void Cancel(uint64_t ticket);
+
+private:
+  struct Entry {
+    std::string path;
+    // Bytes to read, capped by window
+    uint64_t size;
+    bool taken = false;
+    bool started = false;
+  };
+
+  struct Ring;
+
+  using clock = std::chrono::steady_clock;
+  uint64_t window;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Entry> entries;
+  // Ticket of entries.front()
+  uint64_t firstTicket = 0;
+  uint64_t nextTake = 0;
+  // Taken entries that were not started yet
+  uint64_t ahead = 0;
+  size_t aheadFiles = 0;
+  // Adapted to pick up rate of workers
+  uint64_t limitBytes;
+  size_t limitFiles;
+  double byteRate = 0;
+  double fileRate = 0;
+  clock::time_point lastSample = clock::now();
+  uint64_t sampleBytes = 0;
+  size_t sampleFiles = 0;
+  bool stop = false;
+  std::vector<std::thread> threads;
+
+  std::unique_ptr<Ring> ring;
+
+  // Must hold mutex, returns false when nothing can be read right now
+  bool TryTake(std::string &path, uint64_t &size);
+  // Blocks until something can be read, returns false when stopped
+  bool Take(std::string &path, uint64_t &size);
+  bool Stopped();
+  // Must hold mutex
+  void UpdateLimits(uint64_t startedSize);
+  void Remove(uint64_t ticket, bool started);
+  void RingReader();
+  void ThreadReader();
+  void HintReader();
+};
@@ -0,0 +1,124 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ram_storage.hpp"
+#include "datas/master_printer.hpp"
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+#ifdef USEWIN
+void InitRamStorage(uint64_t) {}
+void CleanRamStorage() {}
+RamStorageUsage RamStorageStatus() { return {}; }
+const std::string &RamStorageFolder() {
+  static const std::string none;
+  return none;
+}
+const char *RamStorageRoot() { return nullptr; }
+#else
+#include <linux/magic.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+static constexpr const char RAM_ROOT[] = "/dev/shm";
+static constexpr const char FOLDER_PREFIX[] = "ImSpike-";
+
+static std::string ramFolder;
+static uint64_t ramLimit = 0;
+// tmpfs usage by others when storage was initialized
+static uint64_t baseUsed = 0;
+
+static uint64_t UsedBytes(const struct statfs &st) {
+  return uint64_t(st.f_blocks - st.f_bfree) * st.f_bsize;
+}
+
+void InitRamStorage(uint64_t limit) {
+  if (!limit) {
+    return;
+  }
+
+  struct statfs st;
+
+  if (statfs(RAM_ROOT, &st) || st.f_type != TMPFS_MAGIC) {
+    printwarning("RAM temp storage is not available, " << RAM_ROOT
+                                                       << " is not tmpfs.");
+    return;
+  }
+
+  const uint64_t available = uint64_t(st.f_bavail) * st.f_bsize;
+
+  if (available < limit) {
+    printwarning("Only " << (available >> 20)
+                         << " MiB of RAM temp storage is available.");
+    limit = available;
+  }
+
+  std::error_code ec;
+  ramFolder = std::string(RAM_ROOT) + "/" + FOLDER_PREFIX +
+              std::to_string(getpid());
+  fs::create_directories(ramFolder, ec);
+
+  if (ec) {
+    printwarning("Cannot create RAM temp storage " << ramFolder << ": "
+                                                   << ec.message());
+    ramFolder.clear();
+    return;
+  }
+
+  ramLimit = limit;
+  baseUsed = UsedBytes(st);
+}
+
+const std::string &RamStorageFolder() { return ramFolder; }
+
+const char *RamStorageRoot() { return RAM_ROOT; }
+
+void CleanRamStorage() {
+  if (ramFolder.empty()) {
+    return;
+  }
+
+  std::error_code ec;
+  fs::remove_all(ramFolder, ec);
+  ramFolder.clear();
+}
+
+RamStorageUsage RamStorageStatus() {
+  if (ramFolder.empty()) {
+    return {};
+  }
+
+  RamStorageUsage usage;
+  usage.active = true;
+  usage.limit = ramLimit;
+  struct statfs st;
+
+  if (statfs(RAM_ROOT, &st)) {
+    usage.full = true;
+    return usage;
+  }
+
+  const uint64_t used = UsedBytes(st);
+  usage.used = used > baseUsed ? used - baseUsed : 0;
+  // Others may fill tmpfs meanwhile
+  usage.full = usage.used >= ramLimit ||
+               uint64_t(st.f_bavail) * st.f_bsize < ramLimit - usage.used;
+  return usage;
+}
+#endif
@@ -0,0 +1,43 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <cstdint>
+#include <string>
+
+// Temp folder on tmpfs, exported as TMPDIR by InitTempFolder, so
+// intermediates of modules are kept in RAM. Once usage reaches limit, new
+// files spill over to disk temp folder, see SwitchTempFolder.
+void InitRamStorage(uint64_t limit);
+// Empty when RAM storage is not active
+const std::string &RamStorageFolder();
+// tmpfs holding RAM folders, nullptr where there is none
+const char *RamStorageRoot();
+// Removes RAM folder of this process
+void CleanRamStorage();
+
+struct RamStorageUsage {
+  bool active = false;
+  // Usage reached limit, or tmpfs has no room left for it
+  bool full = false;
+  // Growth of tmpfs usage since InitRamStorage
+  uint64_t used = 0;
+  uint64_t limit = 0;
+};
+
+// Measured by statfs, cheap enough to call for every file
+RamStorageUsage RamStorageStatus();
@@ -0,0 +1,433 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "result_cache.hpp"
+#include "datas/master_printer.hpp"
+#include "datas/pugiex.hpp"
+#include "file_link.hpp"
+#include "planner.hpp"
+#include "shard.hpp"
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static constexpr const char MANIFEST[] = "outputs.xml";
+// Outputs are stored without input stem, so identical inputs under other
+// names restore outputs under their own names
+static constexpr const char STORED_STEM[] = "output";
+static constexpr const char BLOB_FOLDER[] = "blobs";
+
+ResultCache::ResultCache(std::string folder_, uint64_t settingsHash_,
+                         LinkPolicy policy_)
+    : folder(std::move(folder_)), settingsHash(settingsHash_),
+      policy(policy_) {}
+
+// Chunks are hashed in chain
+static constexpr size_t HASH_CHUNK = 1 << 20;
+
+// Size lowers chance of collision of 64 bit hash, empty on error
+// Inputs are read, not mapped, truncated mapping would raise SIGBUS
+static std::string ContentKey(const std::string &path, uint64_t seed) {
+  uint64_t hash = seed;
+  uint64_t fileSize = 0;
+  FILE *file = fopen(path.c_str(), "rb");
+
+  if (!file) {
+    return {};
+  }
+
+  std::vector<char> buffer(HASH_CHUNK);
+
+  while (const size_t numRead = fread(buffer.data(), 1, buffer.size(), file)) {
+    hash = PathHash({buffer.data(), numRead}, hash);
+    fileSize += numRead;
+  }
+
+  const bool failed = ferror(file);
+  fclose(file);
+
+  if (failed) {
+    return {};
+  }
+
+  char key[48]{};
+  snprintf(key, sizeof(key), "%016" PRIx64 "-%" PRIx64, hash, fileSize);
+  return key;
+}
+
+std::string ResultCache::Key(const std::string &inputPath) const {
+  return ContentKey(inputPath, settingsHash);
+}
+
+std::string ResultCache::EntryPath(const std::string &key) const {
+  return folder + "/" + key.substr(0, 2) + "/" + key;
+}
+
+std::string ResultCache::BlobPath(const std::string &blob) const {
+  return folder + "/" + BLOB_FOLDER + "/" + blob.substr(0, 2) + "/" + blob;
+}
+
+bool ResultCache::Write(const std::string &src, const std::string &dst,
+                        uint64_t size, LinkPolicy writePolicy) const {
+  const auto startTime = std::chrono::steady_clock::now();
+  const LinkResult result = Materialize(src, dst, writePolicy);
+
+  if (result == LinkResult::Copied) {
+    stats.copiedBytes += size;
+    stats.copyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - startTime)
+                                  .count();
+  } else if (result != LinkResult::Failed) {
+    stats.linkedBytes += size;
+  }
+
+  return result != LinkResult::Failed;
+}
+
+void ResultCache::PrintSavings() const {
+  folders.PrintSavings("Result cache");
+  const uint64_t savedBytes = stats.linkedBytes + stats.dedupedBytes;
+
+  if (!savedBytes) {
+    return;
+  }
+
+  // Estimated by copy throughput of this run
+  std::string savedTime = "unknown time";
+
+  if (stats.copiedBytes) {
+    savedTime = FormatDuration(double(stats.copyMicroseconds) * 1e-6 *
+                               double(savedBytes) / double(stats.copiedBytes));
+  }
+
+  printinfo("Result cache wrote " << FormatBytes(stats.copiedBytes)
+                                  << ", linked " << FormatBytes(stats.linkedBytes)
+                                  << " and deduplicated "
+                                  << FormatBytes(stats.dedupedBytes)
+                                  << ", saving about " << savedTime
+                                  << " of writing.");
+}
+
+static bool SameContents(const std::string &path0, const std::string &path1) {
+  FILE *file0 = fopen(path0.c_str(), "rb");
+  FILE *file1 = fopen(path1.c_str(), "rb");
+  bool same = file0 && file1;
+
+  if (same) {
+    std::vector<char> buffer0(HASH_CHUNK);
+    std::vector<char> buffer1(HASH_CHUNK);
+
+    while (same) {
+      const size_t numRead0 = fread(buffer0.data(), 1, buffer0.size(), file0);
+      const size_t numRead1 = fread(buffer1.data(), 1, buffer1.size(), file1);
+      same = numRead0 == numRead1 &&
+             !memcmp(buffer0.data(), buffer1.data(), numRead0) &&
+             !ferror(file0) && !ferror(file1);
+
+      if (numRead0 < buffer0.size()) {
+        break;
+      }
+    }
+  }
+
+  if (file0) {
+    fclose(file0);
+  }
+
+  if (file1) {
+    fclose(file1);
+  }
+
+  return same;
+}
+
+static fs::path OutputFolder(const std::string &inputPath) {
+  return fs::path(inputPath).parent_path();
+}
+
+bool ResultCache::Restore(const std::string &key,
+                          const std::string &inputPath) const {
+  if (key.empty()) {
+    return false;
+  }
+
+  const std::string entryPath = EntryPath(key);
+  std::error_code ec;
+
+  if (!fs::exists(entryPath + "/" + MANIFEST, ec)) {
+    return false;
+  }
+
+  try {
+    auto doc = XMLFromFile(entryPath + "/" + MANIFEST);
+    const fs::path outFolder = OutputFolder(inputPath);
+    const std::string stem = fs::path(inputPath).stem().string();
+
+    for (auto output : doc.child("outputs").children("output")) {
+      const std::string suffix = output.attribute("suffix").as_string();
+      const fs::path outPath = outFolder / (stem + suffix);
+      if (!folders.Create(outPath.parent_path())) {
+        throw std::runtime_error("cannot create folder for " +
+                                 outPath.string());
+      }
+
+      const std::string blob = output.attribute("blob").as_string();
+      // Entries made before blob store keep their own copies
+      const std::string cachedPath =
+          blob.empty() ? (fs::path(entryPath) / (STORED_STEM + suffix)).string()
+                       : BlobPath(blob);
+
+      if (!Write(cachedPath, outPath.string(),
+                 output.attribute("size").as_ullong(), policy)) {
+        throw std::runtime_error("cannot write " + outPath.string());
+      }
+    }
+  } catch (const std::exception &e) {
+    printwarning("Cannot restore cached outputs of " << inputPath << ": "
+                                                     << e.what());
+    return false;
+  }
+
+  return true;
+}
+
+static bool IsOutputName(const fs::path &path, const std::string &stem) {
+  const std::string name = path.filename().string();
+  return name.starts_with(stem) &&
+         (name.size() == stem.size() || name[stem.size()] == '.');
+}
+
+// Filesystems stamp files from coarse clock, some with seconds precision
+static constexpr auto TIME_MARGIN = std::chrono::seconds(2);
+
+// Regular files named after stem of input, or inside folders named after
+// it. Other entries of output folder go to other.
+template <class Fn, class OtherFn>
+static void ForEachCandidate(const fs::path &input, Fn &&fn,
+                             OtherFn &&other) {
+  const fs::path outFolder = input.parent_path();
+  const std::string stem = input.stem().string();
+
+  for (auto &e : fs::directory_iterator(outFolder)) {
+    if (!IsOutputName(e.path(), stem)) {
+      other(e);
+      continue;
+    }
+
+    if (e.is_directory()) {
+      for (auto &s : fs::recursive_directory_iterator(e.path())) {
+        if (s.is_regular_file()) {
+          fn(s, false);
+        }
+      }
+    } else if (e.is_regular_file() && e.path() != input) {
+      fn(e, true);
+    }
+  }
+}
+
+static bool IsOtherOutput(const fs::path &path,
+                          const std::set<std::string, std::less<>> &stems) {
+  const std::string name = path.filename().string();
+
+  for (size_t dot = name.find('.'); dot != name.npos;
+       dot = name.find('.', dot + 1)) {
+    if (stems.contains(std::string_view(name).substr(0, dot))) {
+      return true;
+    }
+  }
+
+  return stems.contains(name);
+}
+
+static ResultCache::FileState EntryState(const fs::directory_entry &e) {
+  std::error_code ec;
+  ResultCache::FileState state{e.last_write_time(ec)};
+
+  if (e.is_regular_file(ec)) {
+    state.size = e.file_size(ec);
+  }
+
+  return state;
+}
+
+ResultCache::Snapshot ResultCache::Scan(const std::string &inputPath,
+                                        const input_fn &isInput) {
+  const fs::path input(inputPath);
+  const fs::path outFolder = input.parent_path();
+  Snapshot snapshot;
+  snapshot.time = fs::file_time_type::clock::now();
+  std::vector<fs::directory_entry> others;
+
+  try {
+    ForEachCandidate(
+        input,
+        [&](const fs::directory_entry &e, bool sibling) {
+          if (sibling && isInput && isInput(e.path())) {
+            snapshot.shared = true;
+          }
+
+          snapshot.files.emplace(e.path().lexically_relative(outFolder),
+                                 FileState{e.last_write_time(), e.file_size()});
+        },
+        [&](const fs::directory_entry &e) {
+          if (e.path() == input) {
+            return;
+          }
+
+          if (isInput && e.is_regular_file() && isInput(e.path())) {
+            snapshot.otherStems.emplace(e.path().stem().string());
+          }
+
+          others.push_back(e);
+        });
+
+    // Outputs of other inputs are known only once whole folder was listed
+    for (auto &e : others) {
+      if (!IsOtherOutput(e.path(), snapshot.otherStems)) {
+        snapshot.foreign.emplace(e.path().filename(), EntryState(e));
+      }
+    }
+  } catch (const std::exception &e) {
+    printwarning("Cannot scan outputs of " << inputPath << ": " << e.what());
+    snapshot.shared = true;
+  }
+
+  return snapshot;
+}
+
+ResultCache::Outputs ResultCache::Collect(const std::string &inputPath,
+                                          const Snapshot &before) {
+  const fs::path input(inputPath);
+  const fs::path outFolder = input.parent_path();
+  Outputs outputs;
+  outputs.complete = !before.shared;
+  std::map<fs::path, FileState> foreign;
+
+  try {
+    ForEachCandidate(
+        input,
+        [&](const fs::directory_entry &e, bool) {
+          const fs::path path = e.path().lexically_relative(outFolder);
+          const FileState state{e.last_write_time(), e.file_size()};
+          auto found = before.files.find(path);
+
+          if (found == before.files.end() || found->second != state) {
+            outputs.paths.push_back(path);
+            outputs.numBytes += state.size;
+          } else if (state.time + TIME_MARGIN >= before.time) {
+            // Rewritten with same size within clock tick looks unchanged
+            outputs.complete = false;
+          }
+        },
+        [&](const fs::directory_entry &e) {
+          if (e.path() != input &&
+              !IsOtherOutput(e.path(), before.otherStems)) {
+            foreign.emplace(e.path().filename(), EntryState(e));
+          }
+        });
+  } catch (const std::exception &e) {
+    printwarning("Cannot collect outputs of " << inputPath << ": "
+                                              << e.what());
+    return {.complete = false};
+  }
+
+  // Module wrote outputs not named after input, they would be missing
+  if (foreign != before.foreign) {
+    outputs.complete = false;
+  }
+
+  return outputs;
+}
+
+void ResultCache::Store(const std::string &key, const std::string &inputPath,
+                        const Outputs &outputs) const {
+  // Module might write elsewhere, caching nothing would skip it next time
+  if (key.empty() || outputs.paths.empty() || !outputs.complete) {
+    return;
+  }
+
+  const fs::path input(inputPath);
+  const fs::path outFolder = input.parent_path();
+  const std::string stem = input.stem().string();
+
+  static std::atomic_uint64_t lastTmp{0};
+  const std::string entryPath = EntryPath(key);
+  const std::string tmpPath = entryPath + ".tmp-" + NodeName() + "-" +
+                              std::to_string(++lastTmp);
+  std::error_code ec;
+
+  try {
+    pugi::xml_document doc;
+    auto root = doc.append_child("outputs");
+    root.append_attribute("input").set_value(input.filename().string().c_str());
+
+    for (auto &o : outputs.paths) {
+      const std::string suffix = o.generic_string().substr(stem.size());
+      const std::string outPath = (outFolder / o).string();
+      const std::string blob = ContentKey(outPath, 0);
+
+      if (blob.empty()) {
+        throw std::runtime_error("cannot read " + outPath);
+      }
+
+      const std::string blobPath = BlobPath(blob);
+      const uint64_t size = fs::file_size(outPath);
+
+      if (fs::exists(blobPath, ec)) {
+        // Key is only 64 bit hash and size
+        if (!SameContents(outPath, blobPath)) {
+          throw std::runtime_error("blob " + blob + " has other contents");
+        }
+
+        stats.dedupedBytes += size;
+      } else {
+        const std::string blobTmp = tmpPath + "-" + blob;
+        if (!folders.Create(fs::path(blobPath).parent_path())) {
+          throw std::runtime_error("cannot create folder for " + blobPath);
+        }
+
+        if (!Write(outPath, blobTmp, size, policy)) {
+          throw std::runtime_error("cannot write " + blobTmp);
+        }
+
+        // Same blob stored concurrently has same contents
+        fs::rename(blobTmp, blobPath, ec);
+        fs::remove(blobTmp, ec);
+      }
+
+      auto node = root.append_child("output");
+      node.append_attribute("suffix").set_value(suffix.c_str());
+      node.append_attribute("blob").set_value(blob.c_str());
+      node.append_attribute("size").set_value(size);
+    }
+
+    fs::create_directories(tmpPath);
+    XMLToFile(tmpPath + "/" + MANIFEST, doc);
+    // Loses to entry stored by other node in the meantime
+    fs::rename(tmpPath, entryPath, ec);
+  } catch (const std::exception &e) {
+    printwarning("Cannot cache outputs of " << inputPath << ": " << e.what());
+  }
+
+  fs::remove_all(tmpPath, ec);
+}
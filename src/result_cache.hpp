@@ -0,0 +1,115 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "dir_cache.hpp"
+#include "main.hpp"
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Content addressed store of outputs produced from a single input file.
+// Entry key is made of input contents and hash of module and its settings.
+// Outputs are files next to the input, named after its stem, or inside
+// folder named after its stem, that were added or changed during
+// processing. Inputs sharing stem and folder with other input are not
+// cached, their outputs cannot be told apart. Neither are inputs, during
+// which other files of output folder changed, that are not named after
+// stem of any input in there.
+// Output contents are stored once in blob store, shared by every entry
+// that produced identical output. That only saves space of cache, restored
+// outputs are written out whole unless they can be reflinked.
+class ResultCache {
+public:
+  struct FileState {
+    std::filesystem::file_time_type time;
+    uint64_t size = 0;
+
+    bool operator==(const FileState &) const = default;
+  };
+
+  // Files that could be outputs of input, taken before it's processed
+  struct Snapshot {
+    // Relative to input folder
+    std::map<std::filesystem::path, FileState> files;
+    // Entries of output folder not named after stem of any input
+    std::map<std::filesystem::path, FileState> foreign;
+    // Stems of other inputs in output folder
+    std::set<std::string, std::less<>> otherStems;
+    std::filesystem::file_time_type time;
+    // Other input has same stem in same folder
+    bool shared = false;
+  };
+
+  struct Outputs {
+    // Relative to input folder
+    std::vector<std::filesystem::path> paths;
+    uint64_t numBytes = 0;
+    // False when outputs might be missing or belong to other input
+    bool complete = true;
+  };
+
+  // Tells if full path is queued for processing
+  using input_fn = std::function<bool(const std::filesystem::path &)>;
+
+  // Bytes written into outputs and blobs, by how they were written
+  struct LinkStats {
+    std::atomic_uint64_t copiedBytes{0};
+    std::atomic_uint64_t copyMicroseconds{0};
+    std::atomic_uint64_t linkedBytes{0};
+    // Outputs already present in blob store
+    std::atomic_uint64_t dedupedBytes{0};
+  };
+
+  ResultCache(std::string folder, uint64_t settingsHash, LinkPolicy policy);
+  // Logs space and estimated write time saved by linking and deduplication
+  void PrintSavings() const;
+
+  // Reads whole input, empty on error
+  std::string Key(const std::string &inputPath) const;
+  // Copies cached outputs next to input, false if there is no entry
+  bool Restore(const std::string &key, const std::string &inputPath) const;
+  static Snapshot Scan(const std::string &inputPath, const input_fn &isInput);
+  // Files added or changed since snapshot
+  static Outputs Collect(const std::string &inputPath, const Snapshot &before);
+  // Copies complete collected outputs into cache
+  void Store(const std::string &key, const std::string &inputPath,
+             const Outputs &outputs) const;
+  void Store(const std::string &key, const std::string &inputPath,
+             const Snapshot &before) const {
+    Store(key, inputPath, Collect(inputPath, before));
+  }
+
+private:
+  std::string folder;
+  uint64_t settingsHash;
+  LinkPolicy policy;
+  mutable LinkStats stats;
+  // Output and blob folders
+  mutable DirectoryCache folders;
+
+  std::string EntryPath(const std::string &key) const;
+  std::string BlobPath(const std::string &blob) const;
+  // Materializes by policy and counts it into stats
+  bool Write(const std::string &src, const std::string &dst, uint64_t size,
+             LinkPolicy writePolicy) const;
+};
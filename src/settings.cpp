@@ -18,6 +18,9 @@
 #include "settings.hpp"
 #include "datas/pugiex.hpp"
 #include "imgui_internal.h"
+#include "main.hpp"
+#include <algorithm>
+#include <cstring>
 #include <map>
 
 // COPIED INTERNAL FUNCTIONS
@@ -314,6 +317,76 @@ void LoadSettings(GLFWState &state, pugi::xml_document &doc) {
   }
 }
 
+void LoadSettings(BatchOptions &options, pugi::xml_document &doc) {
+  auto batchState = doc.child("batch_options");
+  if (auto attr = batchState.attribute("ShardIndex")) {
+    options.shardIndex = attr.as_int();
+  }
+
+  if (auto attr = batchState.attribute("ShardCount")) {
+    options.shardCount = attr.as_int();
+  }
+
+  // Hand edited or saved by older version
+  options.shardCount = std::max(options.shardCount, 1);
+  options.shardIndex =
+      std::clamp(options.shardIndex, 0, options.shardCount - 1);
+
+  if (auto attr = batchState.attribute("ShardMode")) {
+    options.shardMode = ShardMode(attr.as_int());
+  }
+
+  if (auto attr = batchState.attribute("ReportFolder")) {
+    options.reportFolder = attr.as_string();
+  }
+
+  if (auto attr = batchState.attribute("LeaseFolder")) {
+    options.leaseFolder = attr.as_string();
+  }
+
+  if (auto attr = batchState.attribute("LeaseChunkSize")) {
+    options.leaseChunkSize = attr.as_int();
+  }
+
+  if (auto attr = batchState.attribute("LeaseTimeout")) {
+    options.leaseTimeout = attr.as_int();
+  }
+
+  if (auto attr = batchState.attribute("WorkerProcesses")) {
+    options.workerProcesses = attr.as_int();
+  }
+
+  if (auto attr = batchState.attribute("WorkerTimeout")) {
+    options.workerTimeout = attr.as_int();
+  }
+
+  if (auto attr = batchState.attribute("PrefetchWindow")) {
+    options.prefetchWindow = attr.as_int();
+  }
+
+  if (auto attr = batchState.attribute("PrefetchMode")) {
+    options.prefetchMode = PrefetchMode(attr.as_int());
+  }
+
+  if (auto attr = batchState.attribute("TempRamLimit")) {
+    options.tempRamLimit = attr.as_int();
+  }
+
+  if (auto attr = batchState.attribute("LinkPolicy")) {
+    // Former hardlink policy falls back to reflink
+    options.linkPolicy =
+        LinkPolicy(std::clamp(attr.as_int(), 0, int(LinkPolicy::Reflink)));
+  }
+
+  if (auto attr = batchState.attribute("LogVerbosity")) {
+    options.logVerbosity = LogVerbosity(attr.as_int());
+  }
+
+  if (auto attr = batchState.attribute("CacheFolder")) {
+    options.cacheFolder = attr.as_string();
+  }
+}
+
 void LoadSettings(ImGuiContext &g, pugi::xml_document &doc) {
   IM_ASSERT(g.Initialized);
   auto imstate = doc.child("imgui_state");
@@ -582,3 +655,57 @@ void SaveSettings(GLFWState &state, ImGuiContext &g, pugi::xml_document &doc) {
   SaveTables(g, state_);
   SaveDocking(g, state_);
 }
+
+void SaveSettings(BatchOptions &options, pugi::xml_document &doc) {
+  doc.remove_child("batch_options");
+  auto batchState = doc.append_child("batch_options");
+  batchState.append_attribute("ShardIndex").set_value(options.shardIndex);
+  batchState.append_attribute("ShardCount").set_value(options.shardCount);
+  batchState.append_attribute("ShardMode").set_value(int(options.shardMode));
+  batchState.append_attribute("ReportFolder")
+      .set_value(options.reportFolder.c_str());
+  batchState.append_attribute("LeaseFolder")
+      .set_value(options.leaseFolder.c_str());
+  batchState.append_attribute("LeaseChunkSize")
+      .set_value(options.leaseChunkSize);
+  batchState.append_attribute("LeaseTimeout").set_value(options.leaseTimeout);
+  batchState.append_attribute("WorkerProcesses")
+      .set_value(options.workerProcesses);
+  batchState.append_attribute("WorkerTimeout")
+      .set_value(options.workerTimeout);
+  batchState.append_attribute("PrefetchWindow")
+      .set_value(options.prefetchWindow);
+  batchState.append_attribute("PrefetchMode")
+      .set_value(int(options.prefetchMode));
+  batchState.append_attribute("TempRamLimit")
+      .set_value(options.tempRamLimit);
+  batchState.append_attribute("LinkPolicy")
+      .set_value(int(options.linkPolicy));
+  batchState.append_attribute("LogVerbosity")
+      .set_value(int(options.logVerbosity));
+  batchState.append_attribute("CacheFolder")
+      .set_value(options.cacheFolder.c_str());
+}
+
+void SaveSettings(BatchOptions &options, const BatchOptions &loaded,
+                  const BatchOptions &overridden, pugi::xml_document &doc) {
+  SaveSettings(options, doc);
+  BatchOptions loadedCopy = loaded;
+  BatchOptions overriddenCopy = overridden;
+  pugi::xml_document loadedDoc;
+  pugi::xml_document overriddenDoc;
+  SaveSettings(loadedCopy, loadedDoc);
+  SaveSettings(overriddenCopy, overriddenDoc);
+  auto loadedState = loadedDoc.child("batch_options");
+  auto overriddenState = overriddenDoc.child("batch_options");
+
+  for (auto attr : doc.child("batch_options").attributes()) {
+    const char *overriddenValue =
+        overriddenState.attribute(attr.name()).as_string();
+
+    // Not changed in UI since start
+    if (!strcmp(attr.as_string(), overriddenValue)) {
+      attr.set_value(loadedState.attribute(attr.name()).as_string());
+    }
+  }
+}
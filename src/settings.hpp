@@ -23,7 +23,14 @@ struct GLFWState {
 };
 
 struct ImGuiContext;
+struct BatchOptions;
 
 void LoadSettings(ImGuiContext &g, pugi::xml_document &doc);
 void LoadSettings(GLFWState &state, pugi::xml_document &doc);
+void LoadSettings(BatchOptions &options, pugi::xml_document &doc);
 void SaveSettings(GLFWState &state, ImGuiContext &g, pugi::xml_document &doc);
+void SaveSettings(BatchOptions &options, pugi::xml_document &doc);
+// Options still as overridden by command line are saved with values loaded
+// from settings, so overrides only last for one session
+void SaveSettings(BatchOptions &options, const BatchOptions &loaded,
+                  const BatchOptions &overridden, pugi::xml_document &doc);
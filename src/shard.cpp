@@ -0,0 +1,223 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "shard.hpp"
+#include "datas/master_printer.hpp"
+#include "datas/pugiex.hpp"
+#include <algorithm>
+#include <filesystem>
+
+#ifdef USEWIN
+#include <process.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+uint64_t PathHash(std::string_view path, uint64_t seed) {
+  for (uint8_t c : path) {
+    seed ^= c;
+    seed *= 0x100000001b3;
+  }
+
+  return seed;
+}
+
+std::string NodeName() {
+  char hostName[256]{};
+#ifdef USEWIN
+  DWORD hostNameSize = sizeof(hostName);
+  GetComputerNameA(hostName, &hostNameSize);
+  const int pid = _getpid();
+#else
+  gethostname(hostName, sizeof(hostName) - 1);
+  const int pid = getpid();
+#endif
+
+  return std::string(hostName) + "-" + std::to_string(pid);
+}
+
+bool ShardFilter::Owns(std::string_view key) const {
+  return PathHash(key) % count == index;
+}
+
+template <class PathFn, class KeyFn>
+static std::vector<bool> SelectItems(const ShardFilter &shard,
+                                     size_t numItems, PathFn &&pathFn,
+                                     KeyFn &&keyFn) {
+  std::vector<bool> retVal(numItems);
+
+  if (shard.mode == ShardMode::PathHash) {
+    for (size_t i = 0; i < numItems; i++) {
+      retVal[i] = shard.Owns(keyFn(i));
+    }
+
+    return retVal;
+  }
+
+  struct Item {
+    uint64_t size;
+    std::string_view key;
+    size_t index;
+  };
+
+  std::vector<Item> items;
+  items.reserve(numItems);
+
+  for (size_t i = 0; i < numItems; i++) {
+    std::error_code ec;
+    const uint64_t fileSize = std::filesystem::file_size(pathFn(i), ec);
+    items.push_back({ec ? 0 : fileSize, keyFn(i), i});
+  }
+
+  // Largest first into least loaded bin, every node arrives at same bins
+  std::sort(items.begin(), items.end(), [](auto &i0, auto &i1) {
+    if (i0.size != i1.size) {
+      return i0.size > i1.size;
+    }
+
+    return i0.key < i1.key;
+  });
+
+  std::vector<uint64_t> loads(shard.count);
+
+  for (auto &i : items) {
+    auto bin = std::min_element(loads.begin(), loads.end());
+    *bin += std::max(i.size, uint64_t(1));
+    retVal[i.index] = size_t(std::distance(loads.begin(), bin)) == shard.index;
+  }
+
+  return retVal;
+}
+
+void ShardFilter::Apply(std::vector<std::string_view> &files,
+                        size_t keyOffset) const {
+  if (!Active()) {
+    return;
+  }
+
+  auto selected = SelectItems(
+      *this, files.size(), [&](size_t i) { return files[i]; },
+      [&](size_t i) { return files[i].substr(keyOffset); });
+  size_t curIndex = 0;
+  std::erase_if(files, [&](auto &) { return !selected[curIndex++]; });
+}
+
+void ShardFilter::Apply(std::vector<const Queue *> &entries) const {
+  if (!Active()) {
+    return;
+  }
+
+  auto selected = SelectItems(
+      *this, entries.size(),
+      [&](size_t i) { return entries[i]->path0 + "/" + entries[i]->path1; },
+      [&](size_t i) { return std::string_view(entries[i]->path1); });
+  size_t curIndex = 0;
+  std::erase_if(entries, [&](auto &) { return !selected[curIndex++]; });
+}
+
+static void WriteReport(const std::string &path,
+                        const pugi::xml_document &doc) {
+  const std::string tmpPath = path + ".tmp-" + NodeName();
+  XMLToFile(tmpPath, doc);
+  std::filesystem::rename(tmpPath, path);
+}
+
+void FinishShardReport(const ShardFilter &shard, const std::string &folder,
+                       const ShardReport &report) {
+  namespace fs = std::filesystem;
+
+  try {
+    fs::create_directories(folder);
+    const std::string shardPrefix = report.jobId + "-shard-";
+    const std::string ownPath =
+        folder + "/" + shardPrefix + std::to_string(shard.index) + ".xml";
+
+    {
+      pugi::xml_document doc;
+      auto node = doc.append_child("shard_report");
+      node.append_attribute("job").set_value(report.jobId.c_str());
+      node.append_attribute("node").set_value(NodeName().c_str());
+      node.append_attribute("index").set_value(shard.index);
+      node.append_attribute("count").set_value(shard.count);
+      node.append_attribute("files").set_value(report.numFiles);
+      node.append_attribute("failed").set_value(report.numFailed);
+      node.append_attribute("bytes").set_value(report.numBytes);
+      node.append_attribute("seconds").set_value(report.seconds);
+      WriteReport(ownPath, doc);
+    }
+
+    // Reports are told apart by job id alone, shards of one run may finish
+    // hours apart. Merged reports are removed, so rerun of same job starts
+    // over.
+    std::vector<pugi::xml_document> reports;
+    std::vector<fs::path> reportPaths;
+
+    for (auto &e : fs::directory_iterator(folder)) {
+      const std::string fileName = e.path().filename().string();
+
+      if (fileName.starts_with(shardPrefix) && fileName.ends_with(".xml")) {
+        reports.emplace_back(XMLFromFile(e.path().string()));
+        reportPaths.push_back(e.path());
+      }
+    }
+
+    if (reports.size() < shard.count) {
+      printinfo("Shard " << shard.index << " finished, waiting for "
+                         << shard.count - reports.size()
+                         << " more shards to merge report.");
+      return;
+    }
+
+    pugi::xml_document merged;
+    auto root = merged.append_child("merged_report");
+    size_t numFiles = 0;
+    size_t numFailed = 0;
+    uint64_t numBytes = 0;
+    double seconds = 0;
+
+    for (auto &r : reports) {
+      auto node = r.child("shard_report");
+      numFiles += node.attribute("files").as_ullong();
+      numFailed += node.attribute("failed").as_ullong();
+      numBytes += node.attribute("bytes").as_ullong();
+      seconds = std::max(seconds, node.attribute("seconds").as_double());
+      root.append_copy(node);
+    }
+
+    root.prepend_attribute("seconds").set_value(seconds);
+    root.prepend_attribute("bytes").set_value(numBytes);
+    root.prepend_attribute("failed").set_value(numFailed);
+    root.prepend_attribute("files").set_value(numFiles);
+    root.prepend_attribute("count").set_value(shard.count);
+    root.prepend_attribute("job").set_value(report.jobId.c_str());
+    WriteReport(folder + "/" + report.jobId + "-merged.xml", merged);
+
+    // Shard finishing at same time might be merging them too
+    for (auto &p : reportPaths) {
+      std::error_code ec;
+      fs::remove(p, ec);
+    }
+
+    printinfo("All " << shard.count << " shards finished: " << numFiles
+                     << " files, " << numBytes << " bytes, " << numFailed
+                     << " failed, slowest shard " << seconds << "s.");
+  } catch (const std::exception &e) {
+    printerror("Cannot write shard report into " << folder << ": "
+                                                  << e.what());
+  }
+}
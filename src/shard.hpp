@@ -0,0 +1,57 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "main.hpp"
+#include <cstdint>
+#include <string_view>
+
+// Stable across nodes and platforms (FNV-1a)
+uint64_t PathHash(std::string_view path, uint64_t seed = 0xcbf29ce484222325);
+
+// Host name and process id, unique for each running instance
+std::string NodeName();
+
+// Deterministic partition of queue items between nodes.
+// Items are identified by path relative to their mount, so nodes can have
+// the shared dataset mounted at different locations.
+struct ShardFilter {
+  size_t index = 0;
+  size_t count = 1;
+  ShardMode mode = ShardMode::PathHash;
+
+  bool Active() const { return count > 1; }
+  bool Owns(std::string_view key) const;
+
+  // Removes files of other shards, keeps original order.
+  // Key of each file begins at keyOffset.
+  void Apply(std::vector<std::string_view> &files, size_t keyOffset) const;
+  void Apply(std::vector<const Queue *> &entries) const;
+};
+
+struct ShardReport {
+  std::string jobId;
+  size_t numFiles = 0;
+  size_t numFailed = 0;
+  uint64_t numBytes = 0;
+  double seconds = 0;
+};
+
+// Stores report of current shard into folder.
+// Whichever node finishes last will merge all reports.
+void FinishShardReport(const ShardFilter &shard, const std::string &folder,
+                       const ShardReport &report);
@@ -0,0 +1,305 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "stat_cache.hpp"
+#include "datas/master_printer.hpp"
+#include "shard.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static constexpr const char CACHE_FOLDER[] = "stat_cache";
+static constexpr char CACHE_MAGIC[8]{'I', 'S', 'S', 'T', 'A', 'T', 'C', 0};
+static constexpr uint32_t CACHE_VERSION = 2;
+static constexpr size_t MAX_ENTRIES = 100000;
+// Cache files of other modules and settings
+static constexpr size_t MAX_CACHES = 32;
+// Last use of stored entries is refreshed this rarely, so mostly unchanged
+// caches are not rewritten every session
+static constexpr int64_t LAST_USED_GRANULARITY = 24 * 60 * 60;
+
+// Header, entries sorted by path, then paths.
+// Offsets are relative to paths, so table can be used in place.
+struct StatCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entrySize;
+  uint64_t numEntries;
+  uint64_t pathsSize;
+};
+
+struct StatCache::StoredEntry {
+  uint64_t pathOffset;
+  uint64_t pathSize;
+  Entry entry;
+};
+
+static int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+static bool FileIdentity(const std::string &path, uint64_t &size,
+                         int64_t &modified) {
+  std::error_code ec;
+  size = fs::file_size(path, ec);
+
+  if (ec) {
+    return false;
+  }
+
+  modified = fs::last_write_time(path, ec).time_since_epoch().count();
+  return !ec;
+}
+
+StatCache::StatCache(std::string_view module, uint64_t settingsHash) {
+  char fileName[32]{};
+  snprintf(fileName, sizeof(fileName), "%016" PRIx64 ".bin",
+           PathHash(module, settingsHash));
+  filePath = std::string(CACHE_FOLDER) + "/" + fileName;
+  mapped = std::make_unique<MappedFile>(filePath, MappedFile::Access::Random);
+  std::string_view data;
+
+  if (mapped->Mapped()) {
+    data = mapped->View();
+  } else {
+    // Mapping is unavailable, table is read whole instead
+    std::ifstream str(filePath, std::ios::binary);
+
+    if (!str) {
+      return;
+    }
+
+    readData.assign(std::istreambuf_iterator<char>(str), {});
+    data = readData;
+  }
+
+  // Only bounds are validated, walking whole table would page it in
+  StatCacheHeader header;
+
+  if (data.size() < sizeof(header)) {
+    return;
+  }
+
+  memcpy(&header, data.data(), sizeof(header));
+
+  if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) ||
+      header.version != CACHE_VERSION ||
+      header.entrySize != sizeof(StoredEntry) ||
+      header.numEntries > data.size() / sizeof(StoredEntry) ||
+      sizeof(header) + header.numEntries * sizeof(StoredEntry) +
+              header.pathsSize !=
+          data.size()) {
+    printwarning("Ignoring invalid " << filePath);
+    return;
+  }
+
+  stored = reinterpret_cast<const StoredEntry *>(data.data() + sizeof(header));
+  numStored = header.numEntries;
+  storedPaths = data.substr(sizeof(header) + numStored * sizeof(StoredEntry));
+}
+
+std::string_view StatCache::StoredPath(const StoredEntry &entry) const {
+  if (entry.pathOffset > storedPaths.size() ||
+      entry.pathSize > storedPaths.size() - entry.pathOffset) {
+    return {};
+  }
+
+  return storedPaths.substr(entry.pathOffset, entry.pathSize);
+}
+
+auto StatCache::FindStored(std::string_view path) const
+    -> std::optional<Entry> {
+  const StoredEntry *end = stored + numStored;
+  auto found = std::lower_bound(
+      stored, end, path,
+      [&](const StoredEntry &e, std::string_view p) { return StoredPath(e) < p; });
+
+  if (found == end || StoredPath(*found) != path) {
+    return std::nullopt;
+  }
+
+  return found->entry;
+}
+
+std::optional<size_t> StatCache::Find(const std::string &path) {
+  uint64_t size;
+  int64_t modified;
+
+  if (!FileIdentity(path, size, modified)) {
+    return std::nullopt;
+  }
+
+  const int64_t now = Now();
+  std::lock_guard<std::mutex> lg(entriesMutex);
+  std::optional<Entry> entry;
+
+  if (auto found = entries.find(path); found != entries.end()) {
+    entry = found->second;
+  } else {
+    entry = FindStored(path);
+  }
+
+  if (!entry || entry->size != size || entry->modified != modified) {
+    return std::nullopt;
+  }
+
+  if (now - entry->lastUsed >= LAST_USED_GRANULARITY) {
+    entry->lastUsed = now;
+    entries.insert_or_assign(path, *entry);
+  }
+
+  return entry->numFiles;
+}
+
+void StatCache::Insert(const std::string &path, size_t numFiles) {
+  uint64_t size;
+  int64_t modified;
+
+  if (!FileIdentity(path, size, modified)) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lg(entriesMutex);
+  entries.insert_or_assign(path, Entry{size, modified, numFiles, Now()});
+}
+
+static void EvictCaches(const std::string &keepPath) {
+  std::error_code ec;
+  std::vector<std::pair<fs::file_time_type, fs::path>> caches;
+
+  for (auto &e : fs::directory_iterator(CACHE_FOLDER, ec)) {
+    if (e.path() != fs::path(keepPath) && e.is_regular_file(ec)) {
+      caches.emplace_back(e.last_write_time(ec), e.path());
+    }
+  }
+
+  if (caches.size() < MAX_CACHES) {
+    return;
+  }
+
+  std::sort(caches.begin(), caches.end());
+
+  for (size_t c = 0; c <= caches.size() - MAX_CACHES; c++) {
+    fs::remove(caches[c].second, ec);
+  }
+}
+
+void StatCache::Save() {
+  std::lock_guard<std::mutex> lg(entriesMutex);
+
+  if (entries.empty()) {
+    return;
+  }
+
+  // Both are sorted, newer entries replace stored ones
+  std::vector<std::pair<std::string_view, Entry>> merged;
+  merged.reserve(numStored + entries.size());
+  auto newEntry = entries.begin();
+
+  for (size_t s = 0; s < numStored; s++) {
+    const std::string_view path = StoredPath(stored[s]);
+
+    for (; newEntry != entries.end() && newEntry->first < path; newEntry++) {
+      merged.emplace_back(newEntry->first, newEntry->second);
+    }
+
+    if (newEntry != entries.end() && newEntry->first == path) {
+      merged.emplace_back(newEntry->first, newEntry->second);
+      newEntry++;
+    } else if (!path.empty()) {
+      merged.emplace_back(path, stored[s].entry);
+    }
+  }
+
+  for (; newEntry != entries.end(); newEntry++) {
+    merged.emplace_back(newEntry->first, newEntry->second);
+  }
+
+  if (merged.size() > MAX_ENTRIES) {
+    std::vector<int64_t> usedTimes;
+    usedTimes.reserve(merged.size());
+
+    for (auto &[_, entry] : merged) {
+      usedTimes.push_back(entry.lastUsed);
+    }
+
+    auto threshold = usedTimes.begin() + (merged.size() - MAX_ENTRIES);
+    std::nth_element(usedTimes.begin(), threshold, usedTimes.end());
+    const int64_t minUsed = *threshold;
+
+    std::erase_if(merged,
+                  [&](auto &item) { return item.second.lastUsed < minUsed; });
+  }
+
+  StatCacheHeader header{};
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.entrySize = sizeof(StoredEntry);
+  header.numEntries = merged.size();
+  std::vector<StoredEntry> table;
+  table.reserve(merged.size());
+
+  for (auto &[path, entry] : merged) {
+    table.push_back({header.pathsSize, path.size(), entry});
+    header.pathsSize += path.size();
+  }
+
+  std::error_code ec;
+  fs::create_directories(CACHE_FOLDER, ec);
+  EvictCaches(filePath);
+
+  // Renamed over, so processes still mapping old table are not affected
+  const std::string tmpPath = filePath + ".tmp-" + NodeName();
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+
+  if (!file) {
+    printwarning("Cannot save " << filePath);
+    return;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(table.data(), sizeof(StoredEntry), table.size(), file);
+
+  for (auto &[path, _] : merged) {
+    fwrite(path.data(), 1, path.size(), file);
+  }
+
+  const bool failed = ferror(file);
+  fclose(file);
+
+  if (failed) {
+    printwarning("Cannot save " << filePath);
+    fs::remove(tmpPath, ec);
+    return;
+  }
+
+  fs::rename(tmpPath, filePath, ec);
+
+  if (ec) {
+    printwarning("Cannot save " << filePath << ": " << ec.message());
+    fs::remove(tmpPath, ec);
+  }
+}
@@ -0,0 +1,70 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include "mapped_file.hpp"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Results of ExtractStat kept between sessions, so archives that were
+// already indexed are not read again. Entries are validated by file size
+// and modification time, one cache file is kept per module and settings.
+// Cache file is a sorted table that is looked up in place through memory
+// mapping, so opening it costs nothing and its pages are shared between
+// processes. Where mapping is unavailable, table is read into memory.
+// New entries are kept aside until Save.
+class StatCache {
+public:
+  StatCache(std::string_view module, uint64_t settingsHash);
+
+  // Thread safe, empty when file is not cached or changed since
+  std::optional<size_t> Find(const std::string &path);
+  // Thread safe
+  void Insert(const std::string &path, size_t numFiles);
+  // Evicts least recently used entries and caches of other settings
+  void Save();
+
+private:
+  struct Entry {
+    uint64_t size;
+    int64_t modified;
+    uint64_t numFiles;
+    // Seconds since epoch
+    int64_t lastUsed;
+  };
+
+  struct StoredEntry;
+
+  std::string filePath;
+  std::unique_ptr<MappedFile> mapped;
+  // Table read whole, when file could not be mapped
+  std::string readData;
+  const StoredEntry *stored = nullptr;
+  size_t numStored = 0;
+  std::string_view storedPaths;
+  // Inserted entries and stored entries with refreshed lastUsed
+  std::map<std::string, Entry, std::less<>> entries;
+  std::mutex entriesMutex;
+
+  std::optional<Entry> FindStored(std::string_view path) const;
+  std::string_view StoredPath(const StoredEntry &entry) const;
+};
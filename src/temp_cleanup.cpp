@@ -0,0 +1,246 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "temp_cleanup.hpp"
+#include "datas/master_printer.hpp"
+#include "planner.hpp"
+#include "ram_storage.hpp"
+#include "spike/tmp_storage.hpp"
+
+#ifdef USEWIN
+// Storages are not kept in per process folders, precore removes them
+void InitTempFolder() {
+  CleanTempStorages();
+  InitTempStorage();
+}
+
+const std::string &DiskTempFolder() {
+  static const std::string none;
+  return none;
+}
+
+void SwitchTempFolder(const std::string &) {}
+
+void StartTempStorageCleanup() {}
+
+void FinishTempStorageCleanup() {}
+#else
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static constexpr const char FOLDER_PREFIX[] = "ImSpike-";
+// Renamed folders of dead processes
+static constexpr const char STALE_PREFIX[] = "ImSpike-stale-";
+
+// Not exposed by glibc
+static constexpr int IOPRIO_CLASS_IDLE = 3;
+static constexpr int IOPRIO_CLASS_SHIFT = 13;
+static constexpr int IOPRIO_WHO_PROCESS = 1;
+
+// Folder given to InitTempFolder or SwitchTempFolder
+static std::string tempFolder;
+static std::string diskFolder;
+static fs::path diskRoot;
+// Process that initialized current temp storage
+static pid_t storageOwner = 0;
+static pid_t folderOwner = 0;
+static std::thread cleanupThread;
+static std::atomic_bool stopCleanup;
+
+static void LowerThreadPriority() {
+  // On Linux both apply to calling thread only
+  setpriority(PRIO_PROCESS, 0, 19);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+          IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+// Renaming is cheap, unlike deleting their contents
+static void MarkStaleFolders(const fs::path &root) {
+  std::error_code ec;
+
+  for (auto &e : fs::directory_iterator(root, ec)) {
+    const std::string name = e.path().filename().string();
+
+    if (!name.starts_with(FOLDER_PREFIX) || name.starts_with(STALE_PREFIX)) {
+      continue;
+    }
+
+    const int pid = atoi(name.c_str() + sizeof(FOLDER_PREFIX) - 1);
+
+    if (pid > 0 && kill(pid, 0) && errno == ESRCH) {
+      std::error_code rec;
+      fs::rename(e.path(),
+                 root / (STALE_PREFIX + std::to_string(getpid()) + "-" +
+                         std::to_string(pid)),
+                 rec);
+    }
+  }
+}
+
+// Returns bytes of removed files, stops early when cleanup is finished
+static uint64_t RemoveFolder(const fs::path &folder) {
+  uint64_t numBytes = 0;
+  std::error_code ec;
+
+  for (auto &e : fs::directory_iterator(folder, ec)) {
+    if (stopCleanup) {
+      return numBytes;
+    }
+
+    std::error_code eec;
+    const auto status = e.symlink_status(eec);
+
+    if (fs::is_directory(status)) {
+      numBytes += RemoveFolder(e.path());
+      continue;
+    }
+
+    if (fs::is_regular_file(status)) {
+      numBytes += e.file_size(eec);
+    }
+
+    fs::remove(e.path(), eec);
+  }
+
+  fs::remove(folder, ec);
+  return numBytes;
+}
+
+// Includes folders left by interrupted cleanups
+static uint64_t RemoveStaleFolders(const fs::path &root) {
+  uint64_t numBytes = 0;
+  std::error_code ec;
+  std::vector<fs::path> stale;
+
+  for (auto &e : fs::directory_iterator(root, ec)) {
+    if (e.path().filename().string().starts_with(STALE_PREFIX)) {
+      stale.push_back(e.path());
+    }
+  }
+
+  for (auto &s : stale) {
+    numBytes += RemoveFolder(s);
+  }
+
+  return numBytes;
+}
+
+void InitTempFolder() {
+  std::error_code ec;
+  // TMPDIR is not overridden yet
+  diskRoot = fs::temp_directory_path(ec);
+  const char *ramRoot = RamStorageRoot();
+  MarkStaleFolders(diskRoot);
+
+  if (ramRoot) {
+    MarkStaleFolders(ramRoot);
+  }
+
+  const fs::path folder = diskRoot / (FOLDER_PREFIX + std::to_string(getpid()));
+
+  if (fs::create_directories(folder, ec); !ec) {
+    diskFolder = folder.string();
+  } else {
+    printwarning("Cannot create temp folder " << folder.string() << ": "
+                                              << ec.message());
+  }
+
+  tempFolder = RamStorageFolder();
+
+  if (tempFolder.empty()) {
+    tempFolder = diskFolder;
+  }
+
+  if (!tempFolder.empty()) {
+    setenv("TMPDIR", tempFolder.c_str(), 1);
+  }
+
+  InitTempStorage();
+  storageOwner = folderOwner = getpid();
+}
+
+const std::string &DiskTempFolder() { return diskFolder; }
+
+void SwitchTempFolder(const std::string &folder) {
+  if (folder.empty() || folder == tempFolder) {
+    return;
+  }
+
+  const pid_t pid = getpid();
+
+  if (storageOwner == pid) {
+    CleanCurrentTempStorage();
+  }
+
+  // Worker processes keep their storages apart from parent and each other
+  std::string tempDir = folder;
+
+  if (pid != folderOwner) {
+    tempDir += "/worker-" + std::to_string(pid);
+    std::error_code ec;
+    fs::create_directories(tempDir, ec);
+  }
+
+  tempFolder = folder;
+  setenv("TMPDIR", tempDir.c_str(), 1);
+  InitTempStorage();
+  storageOwner = pid;
+}
+
+void StartTempStorageCleanup() {
+  cleanupThread = std::thread([ramRoot = RamStorageRoot()] {
+    LowerThreadPriority();
+    const auto startTime = std::chrono::steady_clock::now();
+    const uint64_t diskBytes = RemoveStaleFolders(diskRoot);
+    const uint64_t ramBytes = ramRoot ? RemoveStaleFolders(ramRoot) : 0;
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - startTime)
+                               .count();
+
+    if (ramBytes || diskBytes || seconds >= 1) {
+      printinfo("Temp storage cleanup reclaimed "
+                << FormatBytes(diskBytes) << " on disk and "
+                << FormatBytes(ramBytes) << " in RAM in "
+                << FormatDuration(seconds) << ".");
+    }
+  });
+}
+
+void FinishTempStorageCleanup() {
+  stopCleanup = true;
+
+  if (cleanupThread.joinable()) {
+    cleanupThread.join();
+  }
+
+  // RAM folder is removed by CleanRamStorage
+  if (!diskFolder.empty()) {
+    std::error_code ec;
+    fs::remove_all(diskFolder, ec);
+  }
+}
+#endif
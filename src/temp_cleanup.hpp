@@ -0,0 +1,39 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <string>
+
+// Temp storage of this process lives in ImSpike-<pid> folder of system temp,
+// or in RAM folder when RAM storage is active. The folder is exported as
+// TMPDIR, temp storage is initialized inside of it.
+// Folders of dead processes are renamed aside right away.
+// Must be called after InitRamStorage, before any other thread is started.
+void InitTempFolder();
+// ImSpike-<pid> folder of system temp, created even when RAM storage is
+// active, so files can spill over to disk. Empty when it cannot be created.
+const std::string &DiskTempFolder();
+// Moves temp storage of this process into folder, no-op for empty or current
+// folder. Temp storage must not be in use. Previous storage is removed,
+// unless it was inherited from parent process, which still uses it.
+void SwitchTempFolder(const std::string &folder);
+// Deletes folders renamed aside by InitTempFolder on low priority thread, so
+// startup doesn't wait for thousands of leftover files.
+void StartTempStorageCleanup();
+// Stops deleting leftovers, they are deleted on next start.
+// Removes temp folder of this process, after CleanCurrentTempStorage.
+void FinishTempStorageCleanup();
@@ -19,7 +19,11 @@
 #include "font_awesome4/definitions.h"
 #include "imgui.h"
 #include "main.hpp"
+#include "planner.hpp"
 #include "spike/console.hpp"
+#include <chrono>
+#include <map>
+#include <mutex>
 
 void ProgressBar::PrintLine() {
   const float normState = std::min(curitem * itemDelta, 1.f);
@@ -30,12 +34,83 @@ void ProgressBar::PrintLine() {
   ImGui::ProgressBar(normState, {-1, 0}, percBuffer);
 }
 
+// Throughput of detailed progress bars, kept aside since bars are owned by
+// console lines
+struct ProgressRate {
+  using clock = std::chrono::steady_clock;
+  clock::time_point lastTime;
+  float lastState = 0;
+  // Smoothed progress per second
+  float rate = 0;
+  bool inBytes = false;
+  bool sampled = false;
+};
+
+static std::map<const LogLine *, ProgressRate> progressRates;
+static std::mutex progressRatesMutex;
+
+void ProgressInBytes(const LogLine *bar) {
+  std::lock_guard<std::mutex> lg(progressRatesMutex);
+  progressRates[bar].inBytes = true;
+}
+
 void DetailedProgressBar::PrintLine() {
   const float normState = std::min(curitem * itemDelta, 1.f);
+  const auto now = ProgressRate::clock::now();
+  std::unique_lock<std::mutex> lg(progressRatesMutex);
+  ProgressRate &rate = progressRates[this];
+
+  if (rate.lastTime == ProgressRate::clock::time_point{} ||
+      normState < rate.lastState) {
+    rate.lastTime = now;
+    rate.lastState = normState;
+    rate.rate = 0;
+    rate.sampled = false;
+  }
+
+  const float elapsed =
+      std::chrono::duration<float>(now - rate.lastTime).count();
+
+  // Sampling too often would only measure scheduling noise
+  if (elapsed >= 0.5f) {
+    const float curRate = (normState - rate.lastState) / elapsed;
+    rate.rate = rate.sampled ? rate.rate + 0.2f * (curRate - rate.rate)
+                             : curRate;
+    rate.sampled = true;
+    rate.lastTime = now;
+    rate.lastState = normState;
+  }
+
+  const ProgressRate curRate = rate;
+  lg.unlock();
+
   ImGui::TextUnformatted(label.data());
 
-  char percBuffer[16]{};
-  snprintf(percBuffer, sizeof(percBuffer), "%3u", uint32(normState * 100));
+  if (curRate.sampled && itemDelta > 0) {
+    const double unitsPerSecond = curRate.rate / itemDelta;
+    ImGui::SameLine();
+
+    if (curRate.inBytes) {
+      ImGui::TextDisabled("%s/s",
+                          FormatBytes(uint64_t(unitsPerSecond)).c_str());
+    } else {
+      ImGui::TextDisabled("%.1f/s", unitsPerSecond);
+    }
+  }
+
+  char percBuffer[64]{};
+
+  if (normState >= 1.f) {
+    snprintf(percBuffer, sizeof(percBuffer), "%3u", 100u);
+  } else if (curRate.sampled && curRate.rate > 0) {
+    snprintf(percBuffer, sizeof(percBuffer), "%3u ETA %s",
+             uint32(normState * 100),
+             FormatDuration((1.f - normState) / curRate.rate).c_str());
+  } else {
+    snprintf(percBuffer, sizeof(percBuffer), "%3u ETA --",
+             uint32(normState * 100));
+  }
+
   ImGui::ProgressBar(normState, {-1, 0}, percBuffer);
 }
 
@@ -57,7 +132,7 @@ void LoadingBar::PrintLine() {
 static std::atomic_uint8_t queueIndex{0};
 static std::vector<std::shared_ptr<LogLine>> lineQueue[2];
 
-bool UIStack(bool isDone) {
+bool UIStack(bool isDone, std::atomic_bool *stop) {
   bool readyClose = false;
 
   if (!ImGui::IsPopupOpen("##UISTACK")) {
@@ -78,6 +153,12 @@ bool UIStack(bool isDone) {
     if (ImGui::Button("Close")) {
       readyClose = true;
     }
+  } else if (stop) {
+    ImGui::BeginDisabled(*stop);
+    if (ImGui::Button("Stop")) {
+      *stop = true;
+    }
+    ImGui::EndDisabled();
   }
 
   ImGui::EndPopup();
@@ -99,6 +180,9 @@ void ElementAPI::Clean() {
   for (auto &q : lineQueue) {
     q.clear();
   }
+
+  std::lock_guard<std::mutex> lg(progressRatesMutex);
+  progressRates.clear();
 }
 
 void ElementAPI::Insert(std::unique_ptr<LogLine> &&item, LogLine *where,
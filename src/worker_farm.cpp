@@ -0,0 +1,984 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "worker_farm.hpp"
+#include "datas/master_printer.hpp"
+#include "main.hpp"
+#include "temp_cleanup.hpp"
+#include <cstring>
+#include <stdexcept>
+
+void AppendSetupField(std::string &setup, std::string_view field) {
+  const uint32_t size = field.size();
+  setup.append(reinterpret_cast<const char *>(&size), sizeof(size));
+  setup.append(field);
+}
+
+std::string_view TakeSetupField(std::string_view &setup) {
+  uint32_t size;
+
+  if (setup.size() < sizeof(size)) {
+    throw std::runtime_error("Malformed worker setup");
+  }
+
+  memcpy(&size, setup.data(), sizeof(size));
+  setup.remove_prefix(sizeof(size));
+
+  if (setup.size() < size) {
+    throw std::runtime_error("Malformed worker setup");
+  }
+
+  const std::string_view field = setup.substr(0, size);
+  setup.remove_prefix(size);
+  return field;
+}
+
+#ifdef USEWIN
+void StartWorkerZygote(WorkerFarm::setup_fn) {}
+
+std::unique_ptr<WorkerFarm> MakeWorkerFarm(size_t, std::chrono::seconds,
+                                           std::string) {
+  printwarning("Worker processes are not supported on this platform, "
+               "processing in threads.");
+  return {};
+}
+#else
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <ctime>
+#include <deque>
+#include <linux/futex.h>
+#include <map>
+#include <mutex>
+#include <new>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+// Bounded SPSC queue, usable between processes as long as atomics are
+// lock free. Item is published only by storing tail, so process dying in
+// the middle of push or pop never leaves ring in broken state.
+template <class T, size_t N> struct ShmRing {
+  static_assert((N & (N - 1)) == 0);
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  T cells[N];
+
+  bool TryPush(const T &item) {
+    const uint64_t pos = tail.load(std::memory_order_relaxed);
+
+    if (pos - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+
+    cells[pos & (N - 1)] = item;
+    tail.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Item stays in ring until Pop
+  const T *Front() const {
+    const uint64_t pos = head.load(std::memory_order_relaxed);
+
+    if (pos == tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    return &cells[pos & (N - 1)];
+  }
+
+  void Pop() {
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  size_t Size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+
+  // Only while neither side is running
+  void Reset() {
+    head = 0;
+    tail = 0;
+  }
+};
+
+struct Assignment {
+  // 0 tells worker to exit
+  uint64_t id;
+  char path[4096];
+  // Empty keeps temp folder of previous file
+  char tempFolder[512];
+};
+
+enum class MessageKind : uint32_t {
+  FileDone,
+  FileFailed,
+  Item,
+  Log,
+};
+
+struct Message {
+  MessageKind kind;
+  int32_t logType;
+  uint64_t id;
+  double seconds;
+  char text[488];
+};
+
+constexpr size_t MAX_WORKERS = 256;
+// Files assigned to single worker ahead, so it doesn't wait for main process
+constexpr size_t WORKER_DEPTH = 4;
+// Timeouts and death of zygote are not rung, main process checks them this
+// often while it waits
+constexpr std::chrono::milliseconds CHECK_INTERVAL(100);
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+              std::atomic<uint32_t>::is_always_lock_free);
+
+// Words are in shared memory, so futexes are not process private
+void FutexWait(std::atomic<uint32_t> &word, uint32_t value,
+               std::chrono::milliseconds timeout = {}) {
+  timespec ts{};
+  ts.tv_sec = timeout.count() / 1000;
+  ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, value,
+          timeout.count() ? &ts : nullptr, nullptr, 0);
+}
+
+// Bumps word and wakes everyone sleeping on it
+void Ring(std::atomic<uint32_t> &word) {
+  word.fetch_add(1, std::memory_order_release);
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE,
+          INT32_MAX, nullptr, nullptr, 0);
+}
+
+struct FarmHeader {
+  // Rung by workers and zygote whenever main process has something to do
+  alignas(64) std::atomic<uint32_t> doorbell{0};
+};
+
+// Rings are per worker, so dead worker is cleaned up without touching
+// others. Assigned file is popped only after it's reported, what's left in
+// ring of dead worker was never finished.
+struct WorkerSlot {
+  ShmRing<Assignment, WORKER_DEPTH> assignments;
+  ShmRing<Message, 64> messages;
+  // Assignment id being processed
+  alignas(64) std::atomic<uint64_t> current{0};
+  // Rung by main process after it pushed assignment or popped messages
+  std::atomic<uint32_t> wake{0};
+  // Set by zygote once worker is reaped, after status
+  std::atomic<uint32_t> exited{0};
+  int status = 0;
+};
+
+// Shared memory of farm is header followed by slots
+size_t FarmMemorySize(size_t numWorkers) {
+  return sizeof(FarmHeader) + sizeof(WorkerSlot) * numWorkers;
+}
+
+WorkerSlot *FarmSlots(void *mem) {
+  return reinterpret_cast<WorkerSlot *>(static_cast<char *>(mem) +
+                                        sizeof(FarmHeader));
+}
+
+bool WriteAll(int fd, const void *data, size_t size) {
+  auto begin = static_cast<const char *>(data);
+
+  while (size) {
+    const ssize_t written = send(fd, begin, size, MSG_NOSIGNAL);
+
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (written <= 0) {
+      return false;
+    }
+
+    begin += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+bool ReadAll(int fd, void *data, size_t size) {
+  auto begin = static_cast<char *>(data);
+
+  while (size) {
+    const ssize_t numRead = read(fd, begin, size);
+
+    if (numRead < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (numRead <= 0) {
+      return false;
+    }
+
+    begin += numRead;
+    size -= numRead;
+  }
+
+  return true;
+}
+
+FarmHeader *farmHeader = nullptr;
+WorkerSlot *workerSlot = nullptr;
+
+void SendMessage(const Message &msg) {
+  for (;;) {
+    const uint32_t wake = workerSlot->wake.load(std::memory_order_acquire);
+
+    if (workerSlot->messages.TryPush(msg)) {
+      break;
+    }
+
+    FutexWait(workerSlot->wake, wake);
+  }
+
+  Ring(farmHeader->doorbell);
+}
+
+void ForwardLog(int type, std::string_view payload) {
+  Message msg{MessageKind::Log, type, 0, 0, {}};
+  const size_t textSize = std::min(payload.size(), sizeof(msg.text) - 1);
+  memcpy(msg.text, payload.data(), textSize);
+  SendMessage(msg);
+}
+
+[[noreturn]] void WorkerMain(FarmHeader *header, WorkerSlot *slot,
+                             WorkerFarm::setup_fn setup,
+                             std::string_view setupData) {
+  farmHeader = header;
+  workerSlot = slot;
+  ForwardLogs(ForwardLog);
+  WorkerFarm::process_fn processFile;
+
+  try {
+    processFile = setup(setupData);
+  } catch (const std::exception &e) {
+    printerror("Cannot set up worker process: " << e.what());
+    _exit(1);
+  }
+
+  for (;;) {
+    const Assignment *job;
+
+    for (;;) {
+      const uint32_t wake = slot->wake.load(std::memory_order_acquire);
+
+      if ((job = slot->assignments.Front())) {
+        break;
+      }
+
+      FutexWait(slot->wake, wake);
+    }
+
+    if (!job->id) {
+      _exit(0);
+    }
+
+    slot->current.store(job->id, std::memory_order_release);
+    bool succeeded = true;
+    const auto startTime = std::chrono::steady_clock::now();
+
+    try {
+      SwitchTempFolder(job->tempFolder);
+      processFile(job->path, [id = job->id] {
+        SendMessage({MessageKind::Item, 0, id, 0, {}});
+      });
+    } catch (const std::exception &e) {
+      printerror(job->path << ": " << e.what());
+      succeeded = false;
+    } catch (...) {
+      printerror(job->path << ": Uncaught exception");
+      succeeded = false;
+    }
+
+    const std::chrono::duration<double> duration =
+        std::chrono::steady_clock::now() - startTime;
+    SendMessage({succeeded ? MessageKind::FileDone : MessageKind::FileFailed,
+                 0, job->id, duration.count(), {}});
+    slot->current.store(0, std::memory_order_release);
+    slot->assignments.Pop();
+  }
+}
+
+// Memory of farm travels with request as file descriptor
+struct SpawnRequest {
+  uint64_t memSize;
+  uint32_t slot;
+  uint32_t setupSize;
+};
+
+struct ZygoteChild {
+  void *mem;
+  size_t memSize;
+  WorkerSlot *slot;
+};
+
+bool ReceiveRequest(int sock, SpawnRequest &request, int &memFd,
+                    std::string &setup) {
+  char control[CMSG_SPACE(sizeof(int))]{};
+  iovec iov{&request, sizeof(request)};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t numRead;
+
+  do {
+    numRead = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (numRead < 0 && errno == EINTR);
+
+  const cmsghdr *cmsg = numRead > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+    return false;
+  }
+
+  memcpy(&memFd, CMSG_DATA(cmsg), sizeof(memFd));
+
+  if (!ReadAll(sock, reinterpret_cast<char *>(&request) + numRead,
+               sizeof(request) - numRead)) {
+    close(memFd);
+    return false;
+  }
+
+  setup.resize(request.setupSize);
+
+  if (!ReadAll(sock, setup.data(), setup.size()) ||
+      FarmMemorySize(request.slot + 1) > request.memSize) {
+    close(memFd);
+    return false;
+  }
+
+  return true;
+}
+
+void ReapChildren(std::map<pid_t, ZygoteChild> &children) {
+  int status = 0;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    auto found = children.find(pid);
+
+    if (found == children.end()) {
+      continue;
+    }
+
+    ZygoteChild &child = found->second;
+    child.slot->status = status;
+    child.slot->exited.store(1, std::memory_order_release);
+    Ring(static_cast<FarmHeader *>(child.mem)->doorbell);
+    munmap(child.mem, child.memSize);
+    children.erase(found);
+  }
+}
+
+// Forked while main process is single threaded, forks workers on request
+// and reports their exit statuses into their slots.
+[[noreturn]] void ZygoteMain(int sock, pid_t parent,
+                             WorkerFarm::setup_fn setup) {
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  if (getppid() != parent) {
+    _exit(0);
+  }
+
+  sigset_t childSignal;
+  sigset_t oldMask;
+  sigemptyset(&childSignal);
+  sigaddset(&childSignal, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &childSignal, &oldMask);
+  const int signalFd = signalfd(-1, &childSignal, SFD_CLOEXEC | SFD_NONBLOCK);
+  const pid_t zygote = getpid();
+  std::map<pid_t, ZygoteChild> children;
+  std::string setupData;
+
+  for (;;) {
+    pollfd fds[]{{sock, POLLIN, 0}, {signalFd, POLLIN, 0}};
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      _exit(1);
+    }
+
+    if (fds[1].revents & POLLIN) {
+      signalfd_siginfo info;
+
+      while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+      }
+
+      ReapChildren(children);
+    }
+
+    if (!fds[0].revents) {
+      continue;
+    }
+
+    SpawnRequest request;
+    int memFd = -1;
+
+    // Main process is gone, workers are killed along with zygote
+    if (!ReceiveRequest(sock, request, memFd, setupData)) {
+      _exit(0);
+    }
+
+    void *mem = mmap(nullptr, request.memSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, memFd, 0);
+    int32_t reply = mem == MAP_FAILED ? -errno : 0;
+    close(memFd);
+
+    if (!reply) {
+      WorkerSlot *slot = FarmSlots(mem) + request.slot;
+      const pid_t pid = fork();
+
+      if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+        if (getppid() != zygote) {
+          _exit(1);
+        }
+
+        close(sock);
+        close(signalFd);
+        sigprocmask(SIG_SETMASK, &oldMask, nullptr);
+        WorkerMain(static_cast<FarmHeader *>(mem), slot, setup, setupData);
+      }
+
+      if (pid > 0) {
+        children.emplace(pid, ZygoteChild{mem, request.memSize, slot});
+        reply = pid;
+      } else {
+        reply = -errno;
+        munmap(mem, request.memSize);
+      }
+    }
+
+    if (!WriteAll(sock, &reply, sizeof(reply))) {
+      _exit(0);
+    }
+  }
+}
+
+std::mutex zygoteMutex;
+int zygoteSocket = -1;
+pid_t zygotePid = -1;
+
+// Returns pid of worker, or negative errno
+pid_t SpawnWorker(int memFd, size_t memSize, size_t slot,
+                  const std::string &setup) {
+  std::lock_guard<std::mutex> lg(zygoteMutex);
+
+  if (zygoteSocket < 0) {
+    return -ECHILD;
+  }
+
+  SpawnRequest request{memSize, uint32_t(slot), uint32_t(setup.size())};
+  char control[CMSG_SPACE(sizeof(int))]{};
+  iovec iov{&request, sizeof(request)};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memFd, sizeof(memFd));
+  ssize_t sent;
+
+  do {
+    sent = sendmsg(zygoteSocket, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+
+  int32_t reply = -EPIPE;
+
+  if (sent <= 0 ||
+      !WriteAll(zygoteSocket, reinterpret_cast<char *>(&request) + sent,
+                sizeof(request) - sent) ||
+      !WriteAll(zygoteSocket, setup.data(), setup.size()) ||
+      !ReadAll(zygoteSocket, &reply, sizeof(reply))) {
+    return -EPIPE;
+  }
+
+  return reply;
+}
+
+// Workers are killed along with zygote, it cannot report them
+bool ZygoteAlive() {
+  std::lock_guard<std::mutex> lg(zygoteMutex);
+
+  if (zygotePid > 0 && waitpid(zygotePid, nullptr, WNOHANG) == zygotePid) {
+    printerror("Worker zygote died, worker processes cannot be started.");
+    zygotePid = -1;
+    close(zygoteSocket);
+    zygoteSocket = -1;
+  }
+
+  return zygotePid > 0;
+}
+
+struct WorkerFarmImpl : WorkerFarm {
+  using clock = std::chrono::steady_clock;
+
+  struct Worker {
+    pid_t pid = -1;
+    // Last seen current assignment and since when
+    uint64_t current = 0;
+    clock::time_point since;
+    bool killed = false;
+  };
+
+  int memFd = -1;
+  size_t memSize;
+  FarmHeader *header = nullptr;
+  WorkerSlot *slots = nullptr;
+  std::string setup;
+  std::vector<Worker> workers;
+  struct FarmJob {
+    std::string path;
+    std::string tempFolder;
+  };
+
+  std::map<uint64_t, FarmJob> inFlight;
+  // Not yet assigned to worker
+  std::deque<uint64_t> pending;
+  uint64_t lastId = 0;
+  size_t nextWorker = 0;
+  size_t numRestarts = 0;
+  size_t maxRestarts;
+  std::chrono::seconds fileTimeout;
+  clock::time_point lastCheck = clock::now();
+
+  WorkerFarmImpl(size_t numWorkers, std::chrono::seconds fileTimeout_,
+                 std::string setup_)
+      : memSize(FarmMemorySize(numWorkers)), setup(std::move(setup_)),
+        workers(numWorkers), maxRestarts(numWorkers * 16),
+        fileTimeout(fileTimeout_) {
+    memFd = memfd_create("ImSpike-workers", MFD_CLOEXEC);
+    void *mem = MAP_FAILED;
+
+    if (memFd >= 0 && !ftruncate(memFd, memSize)) {
+      mem = mmap(nullptr, memSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd,
+                 0);
+    }
+
+    if (mem == MAP_FAILED) {
+      if (memFd >= 0) {
+        close(memFd);
+      }
+
+      throw std::runtime_error("Cannot map shared memory for workers");
+    }
+
+    header = new (mem) FarmHeader();
+    slots = FarmSlots(mem);
+
+    for (size_t w = 0; w < workers.size(); w++) {
+      new (slots + w) WorkerSlot();
+      Spawn(w);
+    }
+  }
+
+  ~WorkerFarmImpl() {
+    maxRestarts = 0;
+
+    for (size_t w = 0; w < workers.size(); w++) {
+      Assignment stop{};
+
+      while (workers[w].pid > 0 && !Assign(w, stop)) {
+        Pump(true);
+      }
+    }
+
+    // Workers may still be sending messages of their last files
+    while (AnyAlive()) {
+      Pump(true);
+    }
+
+    for (size_t w = 0; w < workers.size(); w++) {
+      slots[w].~WorkerSlot();
+    }
+
+    header->~FarmHeader();
+    munmap(header, memSize);
+    close(memFd);
+  }
+
+  void Spawn(size_t w) {
+    // Left by previous worker of slot
+    slots[w].assignments.Reset();
+    slots[w].messages.Reset();
+    slots[w].current = 0;
+    slots[w].exited = 0;
+    slots[w].status = 0;
+    workers[w] = {};
+    const pid_t pid = SpawnWorker(memFd, memSize, w, setup);
+
+    if (pid < 0) {
+      printerror("Cannot start worker process: " << strerror(-pid));
+    }
+
+    workers[w].pid = pid;
+  }
+
+  bool Assign(size_t w, const Assignment &job) {
+    if (!slots[w].assignments.TryPush(job)) {
+      return false;
+    }
+
+    Ring(slots[w].wake);
+    return true;
+  }
+
+  void Push(const std::string &path, const std::string &tempFolder) override {
+    if (path.size() >= sizeof(Assignment::path) ||
+        tempFolder.size() >= sizeof(Assignment::tempFolder)) {
+      printerror("Path too long for worker process: " << path);
+      onFile(path, false, 0);
+      return;
+    }
+
+    if (!AnyAlive()) {
+      onFile(path, false, 0);
+      return;
+    }
+
+    const uint64_t id = ++lastId;
+    inFlight.emplace(id, FarmJob{path, tempFolder});
+    pending.push_back(id);
+
+    // Everything else is buffered in worker rings
+    while (!pending.empty()) {
+      Pump(true);
+    }
+  }
+
+  bool AnyAlive() const {
+    return std::any_of(workers.begin(), workers.end(),
+                       [](const Worker &w) { return w.pid > 0; });
+  }
+
+  void Wait() override {
+    while (!inFlight.empty()) {
+      Pump(true);
+    }
+  }
+
+  void WaitUntil(const std::function<bool()> &done) override {
+    while (!inFlight.empty() && !done()) {
+      Pump(true);
+    }
+  }
+
+  // Hands pending files to live workers with least files assigned
+  bool Dispatch() {
+    bool anyAssigned = false;
+
+    while (!pending.empty()) {
+      size_t best = workers.size();
+      size_t bestSize = WORKER_DEPTH;
+
+      for (size_t i = 0; i < workers.size(); i++) {
+        const size_t w = (nextWorker + i) % workers.size();
+
+        if (workers[w].pid <= 0) {
+          continue;
+        }
+
+        if (const size_t size = slots[w].assignments.Size(); size < bestSize) {
+          best = w;
+          bestSize = size;
+        }
+      }
+
+      if (best == workers.size()) {
+        break;
+      }
+
+      const uint64_t id = pending.front();
+      pending.pop_front();
+
+      // Failed while it was pending
+      if (auto found = inFlight.find(id); found != inFlight.end()) {
+        Assignment job;
+        job.id = id;
+        const FarmJob &file = found->second;
+        memcpy(job.path, file.path.c_str(), file.path.size() + 1);
+        memcpy(job.tempFolder, file.tempFolder.c_str(),
+               file.tempFolder.size() + 1);
+        Assign(best, job);
+        anyAssigned = true;
+      }
+
+      nextWorker = best + 1;
+    }
+
+    return anyAssigned;
+  }
+
+  void FinishFile(uint64_t id, bool succeeded, double seconds = 0) {
+    auto found = inFlight.find(id);
+
+    if (found == inFlight.end()) {
+      return;
+    }
+
+    auto path = std::move(found->second.path);
+    inFlight.erase(found);
+
+    if (onFile) {
+      onFile(path, succeeded, seconds);
+    }
+  }
+
+  bool DrainMessages(WorkerSlot &slot) {
+    bool anyMessage = false;
+
+    while (const Message *msg = slot.messages.Front()) {
+      anyMessage = true;
+
+      switch (msg->kind) {
+      case MessageKind::FileDone:
+      case MessageKind::FileFailed:
+        FinishFile(msg->id, msg->kind == MessageKind::FileDone, msg->seconds);
+        break;
+      case MessageKind::Item:
+        if (onItem) {
+          onItem();
+        }
+        break;
+      case MessageKind::Log:
+        switch (es::print::MPType(msg->logType)) {
+        case es::print::MPType::WRN:
+          printwarning(msg->text);
+          break;
+        case es::print::MPType::ERR:
+          printerror(msg->text);
+          break;
+        case es::print::MPType::INF:
+          printinfo(msg->text);
+          break;
+        default:
+          printline(msg->text);
+          break;
+        }
+        break;
+      }
+
+      slot.messages.Pop();
+    }
+
+    // Worker might wait for space
+    if (anyMessage) {
+      Ring(slot.wake);
+    }
+
+    return anyMessage;
+  }
+
+  bool DrainMessages() {
+    bool anyMessage = false;
+
+    for (size_t w = 0; w < workers.size(); w++) {
+      anyMessage |= DrainMessages(slots[w]);
+    }
+
+    return anyMessage;
+  }
+
+  bool ReapWorkers() {
+    bool anyDied = false;
+    const bool zygoteAlive = ZygoteAlive();
+
+    for (size_t w = 0; w < workers.size(); w++) {
+      const bool exited = slots[w].exited.load(std::memory_order_acquire);
+
+      if (workers[w].pid <= 0 || (!exited && zygoteAlive)) {
+        continue;
+      }
+
+      // Killed along with zygote
+      const int status = exited ? slots[w].status : SIGKILL;
+      anyDied = true;
+      // Everything the worker sent before dying is in the ring by now
+      DrainMessages(slots[w]);
+      const uint64_t current = slots[w].current;
+      std::vector<uint64_t> unfinished;
+
+      // Reported files were already removed from inFlight
+      for (size_t i = slots[w].assignments.Size(); i > 0; i--) {
+        unfinished.push_back(slots[w].assignments.Front()->id);
+        slots[w].assignments.Pop();
+      }
+
+      if (auto found = inFlight.find(current); found != inFlight.end()) {
+        if (WIFSIGNALED(status)) {
+          printerror("Worker " << workers[w].pid << " killed by signal "
+                               << WTERMSIG(status)
+                               << " while processing: "
+                               << found->second.path);
+        } else {
+          printerror("Worker " << workers[w].pid << " exited with "
+                               << WEXITSTATUS(status)
+                               << " while processing: "
+                               << found->second.path);
+        }
+
+        FinishFile(current, false);
+      }
+
+      // Never started, handed to other workers first
+      for (auto it = unfinished.rbegin(); it != unfinished.rend(); it++) {
+        if (*it != current && inFlight.contains(*it)) {
+          pending.push_front(*it);
+        }
+      }
+
+      workers[w].pid = -1;
+
+      if (numRestarts < maxRestarts) {
+        numRestarts++;
+        Spawn(w);
+      }
+    }
+
+    if (anyDied && !AnyAlive() && !inFlight.empty()) {
+      printerror("All worker processes died, failing remaining files.");
+      pending.clear();
+
+      while (!inFlight.empty()) {
+        FinishFile(inFlight.begin()->first, false);
+      }
+    }
+
+    return anyDied;
+  }
+
+  // Kills workers stuck on single file, they are restarted by ReapWorkers
+  void CheckTimeouts() {
+    const auto now = clock::now();
+
+    if (!fileTimeout.count() || now - lastCheck < CHECK_INTERVAL) {
+      return;
+    }
+
+    lastCheck = now;
+
+    for (size_t w = 0; w < workers.size(); w++) {
+      Worker &worker = workers[w];
+      const uint64_t current = slots[w].current;
+
+      if (worker.pid <= 0 || worker.killed) {
+        continue;
+      }
+
+      if (current != worker.current) {
+        worker.current = current;
+        worker.since = now;
+      } else if (current && now - worker.since > fileTimeout) {
+        if (auto found = inFlight.find(current); found != inFlight.end()) {
+          printerror("Worker " << worker.pid << " timed out after "
+                               << fileTimeout.count()
+                               << "s while processing: "
+                               << found->second.path);
+        }
+
+        kill(worker.pid, SIGKILL);
+        worker.killed = true;
+      }
+    }
+  }
+
+  void Pump(bool block) {
+    // Read first, so anything rung while pumping wakes the wait right away
+    const uint32_t doorbell = header->doorbell.load(std::memory_order_acquire);
+    const bool anyMessage = DrainMessages();
+    const bool anyDied = ReapWorkers();
+    CheckTimeouts();
+    const bool anyAssigned = Dispatch();
+
+    if (!anyMessage && !anyDied && !anyAssigned && block) {
+      FutexWait(header->doorbell, doorbell, CHECK_INTERVAL);
+    }
+  }
+};
+} // namespace
+
+void StartWorkerZygote(WorkerFarm::setup_fn setup) {
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+    printwarning("Cannot start worker zygote: " << strerror(errno));
+    return;
+  }
+
+  const pid_t parent = getpid();
+  const pid_t pid = fork();
+
+  if (pid == 0) {
+    close(fds[0]);
+    ZygoteMain(fds[1], parent, setup);
+  }
+
+  close(fds[1]);
+
+  if (pid < 0) {
+    printwarning("Cannot start worker zygote: " << strerror(errno));
+    close(fds[0]);
+    return;
+  }
+
+  zygoteSocket = fds[0];
+  zygotePid = pid;
+}
+
+std::unique_ptr<WorkerFarm> MakeWorkerFarm(size_t numWorkers,
+                                           std::chrono::seconds fileTimeout,
+                                           std::string setup) {
+  if (!ZygoteAlive()) {
+    printwarning("Worker processes are not available, processing in "
+                 "threads.");
+    return {};
+  }
+
+  numWorkers = std::min(numWorkers, MAX_WORKERS);
+  return std::make_unique<WorkerFarmImpl>(numWorkers, fileTimeout,
+                                          std::move(setup));
+}
+#endif
@@ -0,0 +1,68 @@
+/*  ImSpike
+    Copyright(C) 2023 Lukas Cone
+
+    This program is free software : you can redistribute it and / or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Processes files in worker processes. Crashing or leaking module only takes
+// down its own worker, which is then restarted.
+// Workers are forked by zygote, which is forked before any thread is started,
+// so they never inherit locks held by other threads. Every worker loads its
+// context from setup given to MakeWorkerFarm.
+// Paths are assigned and results reported back through rings in shared
+// memory, waiting sides sleep on futexes. Callbacks are called from the
+// thread calling Push/Wait.
+// Worker stuck on single file for longer than file timeout is killed.
+struct WorkerFarm {
+  using process_fn = std::function<void(const std::string &path,
+                                        const std::function<void()> &item)>;
+  // Called in worker process, throws when setup cannot be loaded
+  using setup_fn = process_fn (*)(std::string_view setup);
+
+  // Called for every item reported by item callback of process_fn
+  std::function<void()> onItem;
+  // Seconds spent processing file in worker
+  std::function<void(const std::string &path, bool succeeded, double seconds)>
+      onFile;
+
+  // Worker keeps temp storage of file in temp folder, see SwitchTempFolder.
+  // Empty folder keeps the one of previous file.
+  virtual void Push(const std::string &path,
+                    const std::string &tempFolder) = 0;
+  virtual void Wait() = 0;
+  // Waits until done returns true or no file is left
+  virtual void WaitUntil(const std::function<bool()> &done) = 0;
+  virtual ~WorkerFarm() = default;
+};
+
+// Must be called before any other thread is started
+void StartWorkerZygote(WorkerFarm::setup_fn setup);
+
+// Returns nullptr where worker processes are not supported
+// Zero fileTimeout disables it
+std::unique_ptr<WorkerFarm> MakeWorkerFarm(size_t numWorkers,
+                                           std::chrono::seconds fileTimeout,
+                                           std::string setup);
+
+// Setup is composed of length prefixed fields
+void AppendSetupField(std::string &setup, std::string_view field);
+// Throws on malformed setup
+std::string_view TakeSetupField(std::string_view &setup);